@@ -0,0 +1,195 @@
+//Benchmark suite for the raytracer, built and run with "make bench"
+//Generates a fixed set of scenes, renders each one several times at a few resolutions, and prints the results as JSON
+//The raytracer is compiled into this file, so scenes are built and rendered in process without any files
+#define main raytrace_main
+#include "raytrace.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_RUNS 3	//Default number of timed renders of every scene and resolution
+
+typedef struct{	//One generated scene of the suite
+	char* name;
+	int spheres;
+	int lights;
+	double reflective;	//Fraction of spheres that reflect
+	double refractive;	//Fraction of spheres that refract
+} Bench_scene;
+
+typedef struct{	//Results a child process sends back to the parent
+	double seconds[64];	//Wall clock time of each run
+	long rays;	//Rays traced by one run
+	long peak_rss;	//Peak resident set size of the child in kilobytes
+} Bench_result;
+
+Bench_scene bench_scenes[] = {
+	{"diffuse_small", 100, 1, 0, 0},
+	{"diffuse_large", 20000, 1, 0, 0},
+	{"many_lights", 1000, 16, 0, 0},
+	{"reflective", 1000, 2, .5, 0},
+	{"refractive", 1000, 2, 0, .3},
+	{"mixed", 5000, 4, .3, .2}
+};
+
+int bench_resolutions[][2] = {
+	{64, 48},
+	{128, 96},
+	{256, 192}
+};
+
+unsigned int bench_seed;	//State of the generator below, reset before every scene so the suite is the same on every run
+
+double bench_random(double low, double high){	//Return a reproducible pseudo random number between low and high
+	bench_seed = bench_seed*1103515245 + 12345;
+	return low + (high - low)*((bench_seed >> 8) & 0xffffff)/16777216.0;
+}
+
+void build_bench_scene(Bench_scene* bench, Scene* scene){	//Generate a scene the same way read_scene() would fill one in
+	Object* object;
+	int i;
+	
+	bench_seed = 1;
+	object = add_object(scene);	//Camera
+	object->kind = 0;
+	object->camera.width = 2;
+	object->camera.height = 1.5;
+	for(i = 0; i < bench->spheres; i++){	//Spheres in a box in front of the camera
+		object = add_object(scene);
+		object->kind = 1;
+		object->sphere.radius = bench_random(.05, .4);
+		object->sphere.position[0] = bench_random(-6, 6);
+		object->sphere.position[1] = bench_random(-4, 5);
+		object->sphere.position[2] = bench_random(4, 20);
+		object->sphere.diffuse_color[0] = bench_random(0, 1);
+		object->sphere.diffuse_color[1] = bench_random(0, 1);
+		object->sphere.diffuse_color[2] = bench_random(0, 1);
+		object->sphere.specular_color[0] = 1;
+		object->sphere.specular_color[1] = 1;
+		object->sphere.specular_color[2] = 1;
+		object->sphere.ior = 1.5;
+		object->sphere.ns = DEFAULT_NS;
+		if(bench_random(0, 1) < bench->reflective) object->sphere.reflectivity = .4;
+		else if(bench_random(0, 1) < bench->refractive) object->sphere.refractivity = .5;
+	}
+	object = add_object(scene);	//Floor
+	object->kind = 2;
+	object->plane.position[1] = -4;
+	object->plane.normal[1] = 1;
+	object->plane.diffuse_color[1] = 1;
+	object->plane.specular_color[0] = 1;
+	object->plane.specular_color[1] = 1;
+	object->plane.specular_color[2] = 1;
+	object->plane.ior = 1;
+	object->plane.ns = DEFAULT_NS;
+	for(i = 0; i < bench->lights; i++){	//Point lights above the spheres
+		object = add_object(scene);
+		object->kind = 3;
+		object->light.position[0] = bench_random(-8, 8);
+		object->light.position[1] = bench_random(3, 9);
+		object->light.position[2] = bench_random(0, 15);
+		object->light.color[0] = 1;
+		object->light.color[1] = 1;
+		object->light.color[2] = 1;
+		object->light.radial_a0 = .5;
+		object->light.radial_a1 = .05;
+		object->light.radial_a2 = .01;
+	}
+	pack_scene(scene);
+	build_bvh(scene);
+	if(options.light_cutoff > 0) build_light_grid(scene, options.light_cutoff);
+}
+
+void run_bench(Bench_scene* bench, int width, int height, int runs, Bench_result* result){	//Render one scene runs times, this runs in a child process
+	Scene scene = {NULL, -1, 0};
+	Framebuffer framebuffer;
+	Stats stats = {0};
+	struct timespec start;
+	struct rusage usage;
+	int run;
+	
+	build_bench_scene(bench, &scene);
+	create_framebuffer(&framebuffer, width, height, NULL);
+	for(run = 0; run < runs; run++){
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		result->rays = raycast_scene(&scene, &framebuffer, width, height, NULL, &stats);
+		result->seconds[run] = elapsed_seconds(&start);
+	}
+	getrusage(RUSAGE_SELF, &usage);
+	result->peak_rss = usage.ru_maxrss;
+}
+
+int compare_doubles(const void* a, const void* b){	//qsort() comparison for ascending doubles
+	double difference = *(double*)a - *(double*)b;
+	return (difference > 0) - (difference < 0);
+}
+
+int main(int c, char** argv){	//Usage: bench [runs], any raytrace options such as --threads or --simd are passed through
+	Bench_result result;
+	int scene_count = sizeof(bench_scenes)/sizeof(bench_scenes[0]);
+	int resolution_count = sizeof(bench_resolutions)/sizeof(bench_resolutions[0]);
+	int runs = BENCH_RUNS;
+	int pipes[2];
+	int first = 1;
+	int i, j;
+	pid_t child;
+	double best;
+	double median;
+	
+	for(i = 1; i < c; i++){	//Strip out the raytrace options, the only other argument is the run count
+		if(strcmp(argv[i], "--threads") == 0 && i + 1 < c) options.threads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--simd") == 0 && i + 1 < c) options.simd = argv[++i];
+		else if(strcmp(argv[i], "--light-cutoff") == 0 && i + 1 < c) options.light_cutoff = atof(argv[++i]);
+		else if(strcmp(argv[i], "--packets") == 0) options.packets = 1;
+		else if(strcmp(argv[i], "--wavefront") == 0) options.wavefront = 1;
+		else if(is_number(argv[i])) runs = atoi(argv[i]);
+		else{
+			fprintf(stderr, "Error: Usage is bench [--threads N] [--simd KERNEL] [--light-cutoff CUTOFF] [--packets] [--wavefront] [runs]\n");
+			exit(1);
+		}
+	}
+	if(runs < 1 || runs > 64){
+		fprintf(stderr, "Error: The run count must be between 1 and 64\n");
+		exit(1);
+	}
+	select_sphere_kernel();
+	
+	printf("[\n");
+	for(i = 0; i < scene_count; i++){
+		for(j = 0; j < resolution_count; j++){
+			//Every render runs in its own child process, so the peak memory reported belongs to that scene alone
+			if(pipe(pipes) != 0 || (child = fork()) < 0){
+				fprintf(stderr, "Error: Could not start a benchmark process\n");
+				exit(1);
+			}
+			if(child == 0){
+				close(pipes[0]);
+				run_bench(&bench_scenes[i], bench_resolutions[j][0], bench_resolutions[j][1], runs, &result);
+				if(write(pipes[1], &result, sizeof(result)) != sizeof(result)) _exit(1);
+				_exit(0);
+			}
+			close(pipes[1]);
+			if(read(pipes[0], &result, sizeof(result)) != sizeof(result)){
+				fprintf(stderr, "Error: Benchmark of %s at %dx%d failed\n", bench_scenes[i].name,
+						bench_resolutions[j][0], bench_resolutions[j][1]);
+				exit(1);
+			}
+			close(pipes[0]);
+			waitpid(child, NULL, 0);
+	
+			qsort(result.seconds, runs, sizeof(double), compare_doubles);
+			best = result.seconds[0];
+			median = result.seconds[runs/2];
+			printf("%s  {\"scene\": \"%s\", \"spheres\": %d, \"lights\": %d, \"width\": %d, \"height\": %d, \"runs\": %d,\n",
+					first ? "" : ",\n", bench_scenes[i].name, bench_scenes[i].spheres, bench_scenes[i].lights,
+					bench_resolutions[j][0], bench_resolutions[j][1], runs);
+			printf("   \"rays\": %ld, \"best_seconds\": %.6f, \"median_seconds\": %.6f, \"rays_per_second\": %.0f, \"ns_per_ray\": %.2f, \"peak_rss_kb\": %ld}",
+					result.rays, best, median, result.rays/median, median*1e9/result.rays, result.peak_rss);
+			fflush(stdout);
+			first = 0;
+		}
+	}
+	printf("\n]\n");
+	return 0;
+}
@@ -1,11 +1,74 @@
+#define _POSIX_C_SOURCE 200809L	//Needed for mmap(), sysconf(), sockets and pthreads under -std=c99
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD	//The SSE2 and AVX2 sphere kernels are only built for x86
+#endif
+
+#ifdef COUNT_ALLOCATIONS	//Count heap allocations, to check that rendering allocates nothing once its buffers are set up
+long allocation_count = 0;
+
+void* counted_malloc(size_t size){
+	__atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+void* counted_calloc(size_t count, size_t size){
+	__atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+	return calloc(count, size);
+}
+
+void* counted_realloc(void* memory, size_t size){
+	__atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+	return realloc(memory, size);
+}
+
+#define malloc(size) counted_malloc(size)
+#define calloc(count, size) counted_calloc(count, size)
+#define realloc(memory, size) counted_realloc(memory, size)
+
+void report_allocations(long start){	//Print how many allocations were made since start
+	fprintf(stderr, "Allocations during render: %ld\n", __atomic_load_n(&allocation_count, __ATOMIC_RELAXED) - start);
+}
+#endif
 
 #define M_PI  3.14159265358979323846
-#define MAX_RECURSION 7
+#define TILE_SIZE 32	//Width and height in pixels of the tiles handed out to render threads
+#define PROGRESSIVE_STEP 8	//Spacing of the pixels raycast by the first --progressive pass, must divide TILE_SIZE
+#define ARENA_BLOCK_SIZE 65536	//Size in bytes of the first arena block, every block after it doubles in size
+#define BVH_BINS 16	//Number of buckets used when searching for the best SAH split
+#define BVH_LEAF_SIZE 8	//Nodes with this many spheres or fewer always become leaves
+#define BVH_MAX_LEAF_SIZE 32	//Largest leaf the SAH is allowed to choose over splitting
+#define BVH_TRAVERSAL_COST 4	//Cost of visiting a node relative to testing one sphere, the vector kernels make sphere tests cheap
+#define PACKET_SIZE 4	//Rays per packet, primary packets cover a 2x2 block of pixels
+#define SIMD_PADDING 4	//Extra zeroed slots after the sphere constants, so kernels may read a full vector past the last sphere
+#define BVH_MAX_DEPTH 32	//Past this depth nodes are split in half by count, which keeps traversal stacks small
+#define BVH_STACK_SIZE 64
+#define RSCN_VERSION 3	//Bump whenever the layout of compiled .rscn scenes changes
+#define RSCN_ALIGNMENT 64	//Every array in a .rscn file starts on a multiple of this many bytes
+#define DEFAULT_NS 20	//Specular exponent of materials without an "ns" field
+#define MAX_WHOLE_EXPONENT 65536	//Whole exponents up to this are raised by repeated squaring instead of pow()
+#define LIGHT_GRID_MAX 64	//Most cells the light grid has along any axis
+#define SERVE_MAX_PIXELS 33554432	//Most pixels one --serve request may render, 768 MB of double framebuffer
+#define SCENE_LOADING 0	//States of a scene kept loaded by --serve
+#define SCENE_LOADED 1
+#define SCENE_FAILED 2
 
 typedef struct {	//Create structure to be used for our object_array
   int kind; // 0 = camera, 1 = sphere, 2 = plane, 3 = light
@@ -21,6 +84,7 @@ typedef struct {	//Create structure to be used for our object_array
 	  double reflectivity;
 	  double refractivity;
 	  double ior;
+	  double ns;	//Specular exponent, higher is shinier
       double radius;
     } sphere;
     struct {
@@ -30,6 +94,7 @@ typedef struct {	//Create structure to be used for our object_array
 	  double reflectivity;
 	  double refractivity;
 	  double ior;
+	  double ns;
 	  double normal[3];
     } plane;
 	struct {
@@ -45,34 +110,346 @@ typedef struct {	//Create structure to be used for our object_array
   };
 } Object;
 
+typedef struct{	//Value type for vectors and colors, so the shading code can return them without touching the heap
+	double v[3];
+} Vector;
+
 typedef struct{	//Holds object intersection information
-	int best_index;
+	int best_index;	//Primitive number of the closest hit, spheres are numbered first and planes follow them
 	double best_t;
 } Tuple;
 
+typedef struct{	//Node of the bounding volume hierarchy built over the spheres of a scene
+	double min[3];	//Bounding box of every sphere under this node
+	double max[3];
+	int start;	//Leaves: first slot in Bvh.indices, interior nodes: index of the left child (the right child follows it)
+	int count;	//Number of spheres in a leaf, 0 for interior nodes
+	int axis;	//Axis the node was split along, used to visit the nearer child first
+} Bvh_node;
+
+typedef struct{	//Per sphere terms of the intersection quadratic, stored in BVH order so every leaf is one contiguous run
+	double* x;	//Center
+	double* y;
+	double* z;
+	double* x2;	//Squared center coordinates
+	double* y2;
+	double* z2;
+	double* r2;	//Squared radius
+} Sphere_constants;
+
+typedef struct{	//Acceleration structure used by shoot() over the spheres, unbounded planes are tested separately
+	Bvh_node* nodes;
+	int node_count;
+	int* indices;	//Sphere numbers, ordered so that every leaf covers a contiguous run
+	Sphere_constants constants;	//Slot i holds the constants of sphere indices[i]
+} Bvh;
+
+typedef struct{	//Per ray terms of the sphere intersection quadratic, computed once per ray instead of once per sphere
+	double d[3];	//2*Rd
+	double p[3];	//2*Rd*Ro
+	double o[3];	//Ro squared
+	double q[3];	//2*Ro
+	double a2;	//2*a, where a = Rd dot Rd
+	double a4;	//4*a
+} Ray_constants;
+
+typedef struct{	//A bundle of rays traced through the BVH together, every ray shares t_min and the excluded primitive
+	int count;
+	double Ro[PACKET_SIZE][3];
+	double Rd[PACKET_SIZE][3];
+	double t_min;
+	double t_max[PACKET_SIZE];	//Distance each ray is tested up to by occluded_packet()
+	int exclude;
+	Tuple hit[PACKET_SIZE];	//Filled in by closest_hit_packet() and occluded_packet()
+} Ray_packet;
+
+//Intersects a ray with count spheres starting at BVH slot start, keeping the nearest hit past t_min in best_t and best_index
+typedef void (*Sphere_kernel)(Ray_constants*, Bvh*, int, int, double, int, double*, int*);
+
+typedef struct{	//Spheres packed into one array per field, so intersection loops stream through contiguous memory
+	int count;
+	double* x;	//Center
+	double* y;
+	double* z;
+	double* radius;
+	double* radius2;	//Radius squared, filled in by finalize_scene()
+} Sphere_array;
+
+typedef struct{	//Planes packed into one array per field
+	int count;
+	double* x;	//Point on the plane
+	double* y;
+	double* z;
+	double* nx;	//Normal
+	double* ny;
+	double* nz;
+	double (*normal)[3];	//Unit normal used for shading, filled in by finalize_scene()
+} Plane_array;
+
+typedef struct{	//Material of every primitive, indexed by primitive number (spheres first, then planes)
+	double (*diffuse_color)[3];
+	double (*specular_color)[3];
+	double* reflectivity;
+	double* refractivity;
+	double* ior;
+	double* ns;
+	double* local_weight;	//Share of the light shaded at the surface itself, 1 - reflectivity - refractivity
+	int* whole_ns;	//ns if it is a whole number no larger than MAX_WHOLE_EXPONENT, otherwise -1
+} Material_array;
+
+typedef struct{	//Lights packed into one array per field
+	int count;
+	double (*position)[3];
+	double (*color)[3];
+	double (*direction)[3];
+	double* radial_a0;
+	double* radial_a1;
+	double* radial_a2;
+	double* angular_a0;
+	double* theta;
+	double* cos_theta;	//Cosine of the spotlight cutoff angle, filled in by finalize_scene()
+	int* spotlight;	//1 if theta and angular_a0 make this light a spotlight, otherwise it lights every direction
+	int* whole_a0;	//angular_a0 if it is a whole number no larger than MAX_WHOLE_EXPONENT, otherwise -1
+} Light_array;
+
+typedef struct{	//Uniform grid over the space each light reaches, built by build_light_grid() when --light-cutoff is set
+	double* radius;	//Distance past which each light adds no more than the cutoff, INFINITY if it never fades that far
+	int* unbounded;	//Lights with an infinite radius, which are visited from every point
+	int unbounded_count;
+	int size[3];	//Cells along each axis
+	double min[3];	//Lowest corner of the grid
+	double scale[3];	//Cells per unit of distance along each axis
+	int* starts;	//Cell i lists the lights cells[starts[i]] up to cells[starts[i + 1] - 1]
+	int* cells;	//Lights of every cell, in increasing order within each cell
+} Light_grid;
+
+typedef struct{	//Memory that objects are carved out of, so a whole scene lives in a handful of large blocks
+	char** blocks;
+	int block_count;
+	size_t used;	//Bytes handed out from the newest block
+	size_t size;	//Size in bytes of the newest block
+} Arena;
+
+typedef struct{	//A scene, parsed into object_array and then packed by kind for rendering
+	Object** object_array;	//Parsed objects, these are released once pack_scene() has run
+	int object_counter;	//Index of the last object in object_array
+	int object_capacity;	//Number of pointers object_array has room for
+	Arena arena;	//Backs every Object in object_array
+	double camera_width;
+	double camera_height;
+	double camera_position[3];	//Origin of every primary ray, only moved away from 0, 0, 0 by --animate
+	Sphere_array spheres;
+	Plane_array planes;
+	Material_array materials;
+	Light_array lights;
+	Bvh bvh;
+	Light_grid light_grid;	//Empty unless --light-cutoff is set
+} Scene;
+
+typedef struct{	//Position of one object at one frame, read from an --animate keyframe file
+	int kind;	//Kind of object that moves, numbered the same way as Object.kind
+	int index;	//Which object of that kind, counting from 0 in scene file order, always 0 for the camera
+	int frame;
+	double position[3];
+} Keyframe;
+
+typedef struct{	//A file mapped into memory, JSON scenes are read front to back by the parser
+	char* data;
+	size_t size;
+	size_t position;	//Offset of the next character to read
+} Mapped_file;
+
+typedef struct{	//Start of a compiled .rscn scene, the scene's arrays follow in the order listed by scene_sections()
+	char magic[4];	//"RSCN"
+	int version;	//RSCN_VERSION of the raytracer that wrote the file, arrays are stored in its native byte order
+	int sphere_count;
+	int plane_count;
+	int light_count;
+	int node_count;
+	double camera_width;
+	double camera_height;
+} Rscn_header;
+
+typedef struct{	//One array of a compiled scene
+	void** array;	//Scene field pointing at the array
+	size_t size;	//Size of the array in bytes
+} Scene_section;
+
+typedef struct{	//Rectangle of pixels with x0 <= x < x1 and y0 <= y < y1, where row 0 is the top of the image
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} Region;
+
+typedef struct{	//Holds the command line options that change how a scene is rendered
+	int threads;	//Number of render threads, 0 means one per online processor
+	char* simd;	//Sphere kernel to use: "auto", "avx2", "sse2" or "scalar"
+	int packets;	//1 to trace primary rays in 2x2 packets
+	char* framebuffer;	//Framebuffer channel type: "double" or "float"
+	int planar;	//1 to store the framebuffer as separate red, green and blue planes
+	int compile_scene;	//1 to write the input scene out as a .rscn file instead of rendering it
+	int stats;	//1 to print counters and stage timings once the image is written
+	int max_depth;	//Deepest layer of reflection and refraction rays that is shaded, primary rays are layer 1
+	double min_weight;	//Reflection and refraction rays that can add no more than this to a pixel are not traced
+	int wavefront;	//1 to render each tile breadth first, one layer of rays at a time
+	int progressive;	//1 to render coarse passes first, writing the image out after each one
+	char* animate;	//Keyframe file to render an animation from, or NULL to render a single image
+	char* serve;	//Unix socket to answer render requests on, or NULL to render once from the command line
+	Region region;	//Part of the image to render, the whole image if x1 is 0
+	int merge;	//1 to stitch --region images together instead of rendering
+	int aa_min;	//Every pixel is raycast with aa_min x aa_min rays
+	int aa_max;	//Pixels on an edge are raycast again with aa_max x aa_max rays, if that is more than aa_min
+	double aa_threshold;	//Neighboring pixels whose channels differ by more than this are on an edge
+	int diff;	//Largest channel difference --diff allows between two images, or -1 to render instead
+	double light_cutoff;	//Lights are skipped where they can add no more than this to a channel, 0 visits every light
+} Options;
+
+typedef struct{	//Work counters, every thread keeps its own copy and they are added together once rendering is done
+	long primary_rays;
+	long shadow_rays;
+	long reflection_rays;
+	long refraction_rays;
+	long sphere_tests;	//Ray-sphere intersection tests, including the ones done by the vector kernels
+	long plane_tests;
+	int max_depth;	//Deepest recursion layer that was shaded
+} Stats;
+
+typedef struct{	//One contiguous block of color values for a region of the image, rows are stored top to bottom
+	int width;	//Size of the region
+	int height;
+	int image_width;	//Size of the whole image
+	int image_height;
+	Region region;	//Part of the image held
+	int is_float;	//1 if channels are stored as float, 0 if double
+	int planar;	//1 if the channels are three planes of width*height values, 0 if RGB is interleaved per pixel
+	void* data;
+} Framebuffer;
+
+typedef struct{	//Reflection or refraction ray leaving a surface, traced as soon as the surface is reached
+	double Ro[3];
+	double Rd[3];
+	int kind;	//0 for reflection, 1 for refraction
+	double weight;	//How much this ray adds to its pixel
+	Tuple hit;
+} Secondary_ray;
+
+typedef struct{	//A surface reached while shading one pixel, the surfaces being shaded form a stack in their Worker
+	double Ron[3];	//Intersection point
+	double Rd[3];	//Direction of the ray that hit the surface
+	double N[3];	//Surface normal
+	int best_index;	//Object that was hit
+	int layer;	//Primary rays are layer 1, their reflections and refractions layer 2 and so on
+	double weight;	//How much this surface adds to its pixel
+	Vector secondary[2];	//Reflected and refracted color, filled in as each child is finished
+	Secondary_ray children[2];
+	int child_count;
+	int next_child;	//Next child to shade
+} Ray_node;
+
+typedef struct{	//A surface waiting in a wavefront queue, along with where its color goes once it is shaded
+	Ray_node node;
+	int parent;	//Index of the parent surface in the previous wave, or the pixel's position in the tile for primary rays
+	int kind;	//Which child of the parent reached this surface, 0 for reflection and 1 for refraction
+} Wave_node;
+
+typedef struct{	//Every surface of one layer of a tile, traced and shaded together by render_wavefront()
+	Wave_node* nodes;
+	int count;
+	int capacity;
+	char* shadowed;	//Shadow results, one row of one flag per light for every node
+} Wave;
+
+typedef struct{	//Double ended queue of tile indices, its owner pops from the head and other workers steal from the tail
+	int head;
+	int tail;
+	pthread_mutex_t lock;
+} Tile_queue;
+
+typedef struct{	//Which pixels of the image one call to raycast_scene() renders
+	int step;	//Only pixels whose x and y are multiples of step are raycast, each filling the step x step block it starts
+	int skip;	//Pixels whose x and y are multiples of skip were raycast by an earlier pass and are left alone, 0 for none
+	int samples;	//Each pixel is raycast with samples x samples rays spread evenly over it, and their average is stored
+	int* hits;	//If not NULL, gets the object every pixel's rays hit (-1 for none), or -2 if they hit different ones
+	char* refine;	//If not NULL, only pixels flagged here are raycast
+} Render_pass;
+
+typedef struct{	//Holds everything shared by the render threads while raycasting a scene
+	Scene* scene;
+	Framebuffer* framebuffer;
+	Render_pass pass;
+	int N;	//Image width in pixels
+	int M;	//Image height in pixels
+	int x0;	//Pixels being raycast, in the coordinates of primary_ray() where row 0 is the bottom of the image
+	int y0;
+	int x1;
+	int y1;
+	double w;	//Camera width
+	double h;	//Camera height
+	double pixwidth;
+	double pixheight;
+	int tiles_x;
+	int tiles_y;
+	int tile_x0;	//Corner of the first tile, tiles stay on the same grid whatever part of the image is raycast
+	int tile_y0;
+	int num_workers;
+	Tile_queue* queues;	//One queue per worker
+} Render_job;
+
+typedef struct{	//A scene kept loaded by --serve, found again by the path it was loaded from
+	char* path;
+	Scene scene;
+	int state;	//SCENE_LOADING, SCENE_LOADED or SCENE_FAILED
+	pthread_cond_t loaded;	//Signalled when a load of this scene finishes, waited on with the cache's lock
+} Resident_scene;
+
+typedef struct{	//Scenes shared by every connection to a --serve process
+	Resident_scene** scenes;	//Entries never move, as threads wait on their condition variables
+	int count;
+	int capacity;
+	pthread_mutex_t lock;
+} Scene_cache;
+
+typedef struct{	//One client of a --serve process, answered on its own thread
+	int fd;
+	Scene_cache* cache;
+} Connection;
+
+typedef struct{	//Per thread state, workers only ever write to their own pixels, queue and scratch buffers
+	Render_job* job;
+	int id;
+	char* shadowed;	//Packet shadow results, PACKET_SIZE rows of one flag per light
+	Stats stats;	//Work done by this worker, copied from its thread's thread_stats when it finishes
+	Ray_node* ray_stack;	//One Ray_node per layer, options.max_depth of them
+	Wave* waves;	//One queue per layer for --wavefront, options.max_depth of them
+} Worker;
+
 int line = 1;	//Line currently being parsed
+extern char** environ;	//Handed on to the processes --serve spawns
+__thread Stats thread_stats;	//Work done by the current thread, every thread counts its own so no locking is needed
+Options options = {1, "auto", 0, "double", 0, 0, 0, 7, 0, 0, 0, NULL, NULL, {0, 0, 0, 0}, 0, 1, 1, .1, -1, 0};	//Render options, filled in by argument_checker()
 
-// next_c() wraps the getc() function and provides error checking and line
-// number maintenance
-int next_c(FILE* json) {
-  int c = fgetc(json);
+// next_c() returns the next character of the mapped file and provides error
+// checking and line number maintenance
+int next_c(Mapped_file* json) {
+  if (json->position >= json->size) {
+    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+    exit(1);
+  }
+  int c = (unsigned char)json->data[json->position++];
 #ifdef DEBUG
   printf("next_c: '%c'\n", c);
 #endif
   if (c == '\n') {
     line += 1;
   }
-  if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-    exit(1);
-  }
   return c;
 }
 
 
 // expect_c() checks that the next character is d.  If it is not it emits
 // an error.
-void expect_c(FILE* json, int d) {
+void expect_c(Mapped_file* json, int d) {
   int c = next_c(json);
   if (c == d) return;
   fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
@@ -81,19 +458,17 @@ void expect_c(FILE* json, int d) {
 
 
 // skip_ws() skips white space in the file.
-void skip_ws(FILE* json) {
-  int c = next_c(json);
-  while (isspace(c)) {
-    c = next_c(json);
+void skip_ws(Mapped_file* json) {
+  while (json->position < json->size && isspace((unsigned char)json->data[json->position])) {
+    if (json->data[json->position] == '\n') line += 1;
+    json->position++;
   }
-  ungetc(c, json);
 }
 
 
-// next_string() gets the next string from the file handle and emits an error
-// if a string can not be obtained.
-char* next_string(FILE* json) {
-  char buffer[129];
+// next_string() copies the next string from the file into buffer, which must
+// hold 129 characters, and emits an error if a string can not be obtained.
+char* next_string(Mapped_file* json, char* buffer) {
   int c = next_c(json);
   if (c != '"') {
     fprintf(stderr, "Error: Expected string on line %d.\n", line);
@@ -119,22 +494,84 @@ char* next_string(FILE* json) {
     c = next_c(json);
   }
   buffer[i] = 0;
-  return strdup(buffer);	//Return the string in a duplicated buffer
+  return buffer;
 }
 
-double next_number(FILE* json) {	//Parse the next number and return it as a double
+double next_number(Mapped_file* json) {	//Parse the next number and return it as a double
+	//Powers of ten that are exact doubles, for the fast path below
+	static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	char* start = json->data + json->position;
+	char* end = json->data + json->size;
+	char* p = start;
+	unsigned long long mantissa = 0;
+	int mantissa_digits = 0;
+	int digits = 0;
+	int exponent = 0;
+	int exponent_value = 0;
+	int negative = 0;
 	double value;
-	int numDigits = 0;
-	numDigits = fscanf(json, "%lf", &value);
-	if(numDigits == 0){
+	char buffer[64];
+	size_t length;
+	
+	if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	while(p < end && isdigit((unsigned char)*p)){	//Integer part
+		if(mantissa_digits < 19) mantissa = mantissa*10 + (*p - '0');
+		else exponent++;
+		if(mantissa != 0) mantissa_digits++;
+		digits++;
+		p++;
+	}
+	if(p < end && *p == '.'){	//Fraction part
+		p++;
+		while(p < end && isdigit((unsigned char)*p)){
+			if(mantissa_digits < 19){
+				mantissa = mantissa*10 + (*p - '0');
+				exponent--;
+			}
+			if(mantissa != 0) mantissa_digits++;
+			digits++;
+			p++;
+		}
+	}
+	if(digits == 0){
 		fprintf(stderr, "Error: Expected number at line %d\n", line);
 		exit(1);
 	}
-	return value;
+	if(p < end && (*p == 'e' || *p == 'E')){	//Exponent part, only taken if digits follow like strtod() does
+		char* e = p + 1;
+		int exponent_negative = 0;
+		if(e < end && (*e == '-' || *e == '+')) exponent_negative = *e++ == '-';
+		if(e < end && isdigit((unsigned char)*e)){
+			while(e < end && isdigit((unsigned char)*e)){
+				if(exponent_value < 10000) exponent_value = exponent_value*10 + (*e - '0');
+				e++;
+			}
+			exponent += exponent_negative ? -exponent_value : exponent_value;
+			p = e;
+		}
+	}
+	
+	//A mantissa below 2^53 times an exact power of ten rounds once, so it matches strtod() exactly
+	if(mantissa_digits <= 19 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22){
+		value = (double)mantissa;
+		if(exponent < 0) value /= powers_of_ten[-exponent];
+		else value *= powers_of_ten[exponent];
+	}else{	//Otherwise hand the digits to strtod()
+		length = p - start;
+		if(length >= sizeof(buffer)){
+			fprintf(stderr, "Error: Number too long at line %d\n", line);
+			exit(1);
+		}
+		memcpy(buffer, start, length);
+		buffer[length] = 0;
+		value = fabs(strtod(buffer, NULL));
+	}
+	json->position = p - json->data;
+	return negative ? -value : value;
 }
 
-double* next_vector(FILE* json) {	//parse the next vector, and return it in double form
-	double* v = malloc(3*sizeof(double));
+void next_vector(Mapped_file* json, double* v) {	//parse the next vector into v
 	expect_c(json, '[');
 	skip_ws(json);
 	v[0] = next_number(json);
@@ -148,7 +585,6 @@ double* next_vector(FILE* json) {	//parse the next vector, and return it in doub
 	v[2] = next_number(json);
 	skip_ws(json);
 	expect_c(json, ']');
-	return v;
 }
 
 static inline double sqr(double v) {	//Return the square of the number passed in
@@ -173,7 +609,7 @@ double clamp(double input){		//Return 1 if the input is above one, and return 0
 void store_value(Object* input_object, int type_of_field, double input_value, double* input_vector){
 	//type_of_field values: 0 = width, 1 = height, 2 = radius, 3 = diffuse_color, 4 = specular_color, 5 = position, 6 = normal
 	//7 = radial_a0, 8 = radial_a1, 9 = radial_a2, 10 = angular_a0, 11 = color, 12 = direction, 13 = theta
-	//14 = reflectivity, 15 = refractivity, 16 = ior
+	//14 = reflectivity, 15 = refractivity, 16 = ior, 17 = ns
 	//if input_value or input_vector aren't used, a 0 or NULL value should be passed in
 	if(input_object->kind == 0){	//If the object is a camera, store the input into its width or height fields
 		if(type_of_field == 0){
@@ -238,8 +674,14 @@ void store_value(Object* input_object, int type_of_field, double input_value, do
 		}else if(type_of_field == 16){
 			if(input_value < 1) input_value = 1;
 			input_object->sphere.ior = input_value;
+		}else if(type_of_field == 17){
+			if(input_value < 0){
+				fprintf(stderr, "Error: ns may not be negative, line:%d\n", line);
+				exit(1);
+			}
+			input_object->sphere.ns = input_value;
 		}else{
-			fprintf(stderr, "Error: Spheres only have 'radius', 'specular_color', 'diffuse_color', or 'position' fields, line:%d\n", line);
+			fprintf(stderr, "Error: Spheres only have 'radius', 'specular_color', 'diffuse_color', 'ns', or 'position' fields, line:%d\n", line);
 			exit(1);
 		}
 	}else if(input_object->kind == 2){	//If the object is a plane, store input into its respective fields
@@ -297,8 +739,14 @@ void store_value(Object* input_object, int type_of_field, double input_value, do
 		}else if(type_of_field == 16){
 			if(input_value < 1) input_value = 1;
 			input_object->plane.ior = input_value;
+		}else if(type_of_field == 17){
+			if(input_value < 0){
+				fprintf(stderr, "Error: ns may not be negative, line:%d\n", line);
+				exit(1);
+			}
+			input_object->plane.ns = input_value;
 		}else{
-			fprintf(stderr, "Error: Planes only have 'radius', 'specular_color', 'diffuse_color', or 'normal' fields, line:%d\n", line);
+			fprintf(stderr, "Error: Planes only have 'radius', 'specular_color', 'diffuse_color', 'ns', or 'normal' fields, line:%d\n", line);
 			exit(1);
 		}
 	}else if(input_object->kind == 3){	//If object is a light, store input into its respective fields
@@ -340,18 +788,87 @@ double degrees_to_radians(double value){	//Converts input from degrees to radian
 	return 2*M_PI*value/360;
 }
 
-int read_scene(char* filename, Object** object_array) {	//Parses json file, and stores object information into object_array
+void* arena_alloc(Arena* arena, size_t size){	//Return size bytes from the arena, adding a bigger block when the newest one is full
+	void* memory;
+	size = (size + 15) & ~(size_t)15;	//Keep every allocation 16 byte aligned
+	if(arena->block_count == 0 || arena->used + size > arena->size){
+		arena->size = arena->block_count == 0 ? ARENA_BLOCK_SIZE : 2*arena->size;
+		if(arena->size < size) arena->size = size;
+		arena->blocks = realloc(arena->blocks, sizeof(char*)*(arena->block_count + 1));
+		if(arena->blocks == NULL || (arena->blocks[arena->block_count] = malloc(arena->size)) == NULL){
+			fprintf(stderr, "Error: Out of memory while loading scene\n");
+			exit(1);
+		}
+		arena->block_count++;
+		arena->used = 0;
+	}
+	memory = arena->blocks[arena->block_count - 1] + arena->used;
+	arena->used += size;
+	return memory;
+}
+
+Object* add_object(Scene* scene){	//Append a zeroed object to the scene, growing object_array as needed
+	if(scene->object_counter + 1 >= scene->object_capacity){	//Double the pointer array whenever it fills up
+		scene->object_capacity = scene->object_capacity == 0 ? 64 : 2*scene->object_capacity;
+		scene->object_array = realloc(scene->object_array, sizeof(Object*)*scene->object_capacity);
+		if(scene->object_array == NULL){
+			fprintf(stderr, "Error: Out of memory while loading scene\n");
+			exit(1);
+		}
+	}
+	scene->object_array[++scene->object_counter] = arena_alloc(&scene->arena, sizeof(Object));
+	memset(scene->object_array[scene->object_counter], 0, sizeof(Object));
+	return scene->object_array[scene->object_counter];
+}
+
+//Map a whole file into memory for reading, returns 1 if it was mapped and 0 (after printing why) if not
+int open_mapped_file(char* filename, Mapped_file* file){
+  struct stat info;
+  int descriptor = open(filename, O_RDONLY);
+
+  if (descriptor < 0 || fstat(descriptor, &info) != 0) {	//If the file does not exist, throw an error
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    if (descriptor >= 0) close(descriptor);
+    return 0;
+  }
+  file->data = NULL;
+  file->size = info.st_size;
+  file->position = 0;
+  if (file->size > 0) {	//mmap() refuses empty files, those fail later as an unexpected end of file
+    //A private writable mapping is copy on write, so arrays pointing into it act like any other scene memory
+    file->data = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+    if (file->data == MAP_FAILED) {
+      fprintf(stderr, "Error: Could not read file \"%s\"\n", filename);
+      close(descriptor);
+      return 0;
+    }
+  }
+  close(descriptor);
+  return 1;
+}
+
+void map_file(char* filename, Mapped_file* file){	//Map a whole file into memory for reading, exiting if it can not be read
+  if (!open_mapped_file(filename, file)) exit(1);
+}
+
+void unmap_file(Mapped_file* file){	//Release a file mapped by map_file()
+  if (file->data != NULL) munmap(file->data, file->size);
+  file->data = NULL;
+}
+
+int read_scene(char* filename, Scene* scene) {	//Parses json file, and stores object information into the scene's object_array
   int c;
   int num_objects = 0;
-  int object_counter = -1;
+  Object* object = NULL;	//Object currently being parsed
   int height = 0, width = 0, radius = 0, diffuse_color = 0, specular_color = 0, position = 0, normal = 0;	//These will serve as boolean operators
-  int radial_a2 = 0, radial_a1 = 0, radial_a0 = 0, angular_a0 = 0, color = 0, theta = 0, ior = 0;
-  FILE* json = fopen(filename, "r");	//Open our json file
+  int radial_a2 = 0, radial_a1 = 0, radial_a0 = 0, angular_a0 = 0, color = 0, theta = 0, ior = 0, ns = 0;
+  char key[129];	//Keys and values are read into these buffers, so nothing is allocated per string
+  char value[129];
+  double vector[3];
+  Mapped_file file;
+  Mapped_file* json = &file;
 
-  if (json == NULL) {	//If the file does not exist, throw an error
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-    exit(1);
-  }
+  map_file(filename, json);	//Map our json file
   
   skip_ws(json);
   
@@ -362,27 +879,23 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
 
   // Find the objects
   while (1) {
-    c = fgetc(json);
+    c = next_c(json);
     if (c == ']' && num_objects != 0) {		//A ',' must be read before getting here, which means we are expecting more objects
       fprintf(stderr, "Error: End of file reached when expecting more objects, line:%d\n", line);
       exit(1);
     }
 	else if(c == ']'){	//If no objects have been parsed and a bracket is found, our file is empty, throw an error
 		fprintf(stderr, "Error: JSON file contains no objects\n");
-		fclose(json);
+		unmap_file(json);
 		exit(1);
 	}
 	
     if (c == '{') {	//Start object parsing
-	  if(object_counter >= 128){	//If 128 objects have already been scanned, throw an error
-		  fprintf(stderr, "Error: Maximum amount of objects allowed (not including the camera) is 128, line:%d\n", line);
-		  exit(1);
-	  }
-	  object_array[++object_counter] = malloc(sizeof(Object)); //Make space for the new object in object_array
+	  object = add_object(scene); //Make space for the new object in object_array
       skip_ws(json);
     
       // Parse object type
-      char* key = next_string(json);
+      next_string(json, key);
       if (strcmp(key, "type") != 0) {
 	fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
 	exit(1);
@@ -394,28 +907,30 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
 
       skip_ws(json);
 
-      char* value = next_string(json);
+      next_string(json, value);
 
       if (strcmp(value, "camera") == 0) {
-		  object_array[object_counter]->kind = 0;	//If camera, set object kind to 0
+		  object->kind = 0;	//If camera, set object kind to 0
 		  width = 1;
 		  height = 1;
       } else if (strcmp(value, "sphere") == 0) {
-		  object_array[object_counter]->kind = 1;	//If sphere, set object kind to 1
+		  object->kind = 1;	//If sphere, set object kind to 1
 		  position = 1;
 		  radius = 1;
 		  specular_color = 1;
 		  diffuse_color = 1;
 		  ior = 1;
+		  ns = 1;
       } else if (strcmp(value, "plane") == 0) {
-		  object_array[object_counter]->kind = 2;	//If plane, set object kind to 2
+		  object->kind = 2;	//If plane, set object kind to 2
 		  position = 1;
 		  normal = 1;
 		  specular_color = 1;
 		  diffuse_color = 1;
 		  ior = 1;
+		  ns = 1;
       } else if (strcmp(value, "light") == 0){		//If light, set object kind to 3
-		  object_array[object_counter]->kind = 3;
+		  object->kind = 3;
 		  position = 1;
 		  color = 1;
 		  radial_a0 = 1;
@@ -442,102 +957,110 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
 			  exit(1);
 		  }
 		  if(radial_a0 == 1){	//If radial_a0 did not exist in json file, store the default value 1
-			  store_value(object_array[object_counter], 7, 1, NULL);
+			  store_value(object, 7, 1, NULL);
 			  radial_a0 = 0;
 		  }
 		  if(radial_a1 == 1){	//If radial_a1 did not exist in json file, store the default value 0
-			  store_value(object_array[object_counter], 8, 0, NULL);
+			  store_value(object, 8, 0, NULL);
 			  radial_a1 = 0;
 		  }
 		  if(radial_a2 == 1){	//If radial_a2 did not exist in json file, store the default value 0
-			  store_value(object_array[object_counter], 9, 0, NULL);
+			  store_value(object, 9, 0, NULL);
 			  radial_a2 = 0;
 		  }
 		  if(angular_a0 == 1){	//If angular_a0 did not exist in json file, store default value 0
-			  store_value(object_array[object_counter], 10, 0, NULL);
+			  store_value(object, 10, 0, NULL);
 			  angular_a0 = 0;
 		  }
 		  if(theta == 1){	//If theta did not exist in json file, store default value 0
-			  store_value(object_array[object_counter], 13, 0, NULL);
+			  store_value(object, 13, 0, NULL);
 			  theta = 0;
 		  }
 		  if(ior == 1){
-			  store_value(object_array[object_counter], 16, 1, NULL);
+			  store_value(object, 16, 1, NULL);
 			  ior = 0;
 		  }
+		  if(ns == 1){	//If ns did not exist in json file, store the default value
+			  store_value(object, 17, DEFAULT_NS, NULL);
+			  ns = 0;
+		  }
 		  break;
 		} else if (c == ',') {
 		  // read another field
 		  skip_ws(json);
-		  char* key = next_string(json);
+		  next_string(json, key);
 		  skip_ws(json);
 		  expect_c(json, ':');
 		  skip_ws(json);
 		  if (strcmp(key, "width") == 0){	//Based on the field, parse a number or vector
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 0, value, NULL);	//And store the value in the object_array
+			  store_value(object, 0, value, NULL);	//And store the value in the object_array
 			  width = 0;
 		  }else if(strcmp(key, "height") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 1, value, NULL);
+			  store_value(object, 1, value, NULL);
 			  height = 0;
 		  }else if(strcmp(key, "radius") == 0) {
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 2, value, NULL);
+			  store_value(object, 2, value, NULL);
 			  radius = 0;
 		  }else if (strcmp(key, "color") == 0){
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 11, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 11, 0, vector);
 			  color = 0;
 		  }else if(strcmp(key, "position") == 0){
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 5, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 5, 0, vector);
 			  position = 0;
 		  }else if(strcmp(key, "normal") == 0) {
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 6, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 6, 0, vector);
 			  normal = 0;
 		  }else if(strcmp(key, "diffuse_color") == 0){
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 3, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 3, 0, vector);
 			  diffuse_color = 0;
 		  }else if(strcmp(key, "specular_color") == 0){
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 4, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 4, 0, vector);
 			  specular_color = 0;
 		  }else if(strcmp(key, "radial-a0") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 7, value, NULL);
+			  store_value(object, 7, value, NULL);
 			  radial_a0 = 0;
 		  }else if(strcmp(key, "radial-a1") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 8, value, NULL);
+			  store_value(object, 8, value, NULL);
 			  radial_a1 = 0;
 		  }else if(strcmp(key, "radial-a2") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 9, value, NULL);
+			  store_value(object, 9, value, NULL);
 			  radial_a2 = 0;
 		  }else if(strcmp(key, "angular-a0") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 10, value, NULL);
+			  store_value(object, 10, value, NULL);
 			  angular_a0 = 0;
 		  }else if(strcmp(key, "direction") == 0){
-			  double* value = next_vector(json);
-			  store_value(object_array[object_counter], 12, 0, value);
+			  next_vector(json, vector);
+			  store_value(object, 12, 0, vector);
 		  }else if(strcmp(key, "theta") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 13, degrees_to_radians(value), NULL);
+			  store_value(object, 13, degrees_to_radians(value), NULL);
 			  theta = 0;
 		  }else if(strcmp(key, "reflectivity") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 14, value, NULL);
+			  store_value(object, 14, value, NULL);
 		  }else if(strcmp(key, "refractivity") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 15, value, NULL);
+			  store_value(object, 15, value, NULL);
 		  }else if(strcmp(key, "ior") == 0){
 			  double value = next_number(json);
-			  store_value(object_array[object_counter], 16, value, NULL);
+			  store_value(object, 16, value, NULL);
 			  ior = 0;
+		  }else if(strcmp(key, "ns") == 0){
+			  double value = next_number(json);
+			  store_value(object, 17, value, NULL);
+			  ns = 0;
 		  }else{	//If there was an invalid field, throw an error
 				fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
 				key, line);
@@ -556,8 +1079,8 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
 	// noop
 	skip_ws(json);
       } else if (c == ']') {	//If there is an ending bracket, it is the end JSON file
-	fclose(json);
-	return object_counter;
+	unmap_file(json);
+	return scene->object_counter;
       } else {	//Throw error if we don't encounter a ',' or ']'
 	fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
 	exit(1);
@@ -566,10 +1089,270 @@ int read_scene(char* filename, Object** object_array) {	//Parses json file, and
   }
 }
 
-void argument_checker(int c, char** argv){	//Check input arguments for validity
+int read_keyframes(char* filename, Keyframe** keyframes){	//Parse an --animate keyframe file into keyframes, and return how many there are
+	Mapped_file file;
+	Keyframe* keyframe;
+	char key[129];	//Keys and values are read into these buffers, so nothing is allocated per string
+	char value[129];
+	double number;
+	int count = 0;
+	int capacity = 0;
+	int has_frame;
+	int has_position;
+	int c;
+	
+	*keyframes = NULL;
+	line = 1;
+	map_file(filename, &file);
+	skip_ws(&file);
+	expect_c(&file, '[');
+	skip_ws(&file);
+	while(1){	//Parse each keyframe, which looks like a scene object
+		expect_c(&file, '{');
+		skip_ws(&file);
+		if(count == capacity){	//Double the keyframe array whenever it fills up
+			capacity = capacity == 0 ? 16 : 2*capacity;
+			*keyframes = realloc(*keyframes, sizeof(Keyframe)*capacity);
+			if(*keyframes == NULL){
+				fprintf(stderr, "Error: Out of memory while loading keyframes\n");
+				exit(1);
+			}
+		}
+		keyframe = &(*keyframes)[count++];
+		memset(keyframe, 0, sizeof(Keyframe));
+		keyframe->kind = -1;
+		has_frame = 0;
+		has_position = 0;
+		
+		c = ',';
+		while(c == ','){	//Parse the fields of this keyframe
+			next_string(&file, key);
+			skip_ws(&file);
+			expect_c(&file, ':');
+			skip_ws(&file);
+			if(strcmp(key, "type") == 0){
+				next_string(&file, value);
+				if(strcmp(value, "camera") == 0) keyframe->kind = 0;
+				else if(strcmp(value, "sphere") == 0) keyframe->kind = 1;
+				else if(strcmp(value, "plane") == 0) keyframe->kind = 2;
+				else if(strcmp(value, "light") == 0) keyframe->kind = 3;
+				else{
+					fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
+					exit(1);
+				}
+			}else if(strcmp(key, "index") == 0 || strcmp(key, "frame") == 0){
+				number = next_number(&file);
+				if(number < 0 || number > 1e9 || number != floor(number)){
+					fprintf(stderr, "Error: Keyframe %s must be a whole number of 0 or more, line:%d\n", key, line);
+					exit(1);
+				}
+				if(key[0] == 'i'){
+					keyframe->index = (int)number;
+				}else{
+					keyframe->frame = (int)number;
+					has_frame = 1;
+				}
+			}else if(strcmp(key, "position") == 0){
+				next_vector(&file, keyframe->position);
+				has_position = 1;
+			}else{
+				fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n", key, line);
+				exit(1);
+			}
+			skip_ws(&file);
+			c = next_c(&file);
+			if(c == ',') skip_ws(&file);
+			else if(c != '}'){
+				fprintf(stderr, "Error: Unexpected value on line %d\n", line);
+				exit(1);
+			}
+		}
+		if(keyframe->kind == -1 || !has_frame || !has_position){
+			fprintf(stderr, "Error: Keyframes need \"type\", \"frame\" and \"position\" fields, line:%d\n", line);
+			exit(1);
+		}
+		
+		skip_ws(&file);
+		c = next_c(&file);
+		if(c == ']') break;
+		if(c != ','){
+			fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
+			exit(1);
+		}
+		skip_ws(&file);
+	}
+	unmap_file(&file);
+	return count;
+}
+
+int is_number(char* input){	//Return 1 if the input string is a non-empty string of digits
+	if(*input == 0) return 0;
+	while(*input != 0){
+		if(!isdigit(*input)) return 0;
+		input++;
+	}
+	return 1;
+}
+
+int has_extension(char* filename, char* extension){	//Return 1 if filename ends in extension
+	char* periodPointer = strrchr(filename, '.');
+	return periodPointer != NULL && strcmp(periodPointer, extension) == 0;
+}
+
+int argument_checker(int c, char** argv){	//Check input arguments for validity, and strip any options out of argv
 	int i = 0;
 	int j = 0;
+	int arg_count = 1;
 	char* periodPointer;
+	char* end;
+	
+	for(i = 1; i < c; i++){	//Store "--" options, and shift the remaining arguments down in argv
+		if(strcmp(argv[i], "--threads") == 0){
+			if(i + 1 >= c || !is_number(argv[i + 1])){
+				fprintf(stderr, "Error: --threads must be followed by a number\n");
+				exit(1);
+			}
+			options.threads = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "--simd") == 0){
+			if(i + 1 >= c || (strcmp(argv[i + 1], "auto") != 0 && strcmp(argv[i + 1], "avx2") != 0 &&
+				strcmp(argv[i + 1], "sse2") != 0 && strcmp(argv[i + 1], "scalar") != 0)){
+				fprintf(stderr, "Error: --simd must be followed by auto, avx2, sse2 or scalar\n");
+				exit(1);
+			}
+			options.simd = argv[++i];
+		}else if(strcmp(argv[i], "--packets") == 0){
+			options.packets = 1;
+		}else if(strcmp(argv[i], "--framebuffer") == 0){
+			if(i + 1 >= c || (strcmp(argv[i + 1], "double") != 0 && strcmp(argv[i + 1], "float") != 0)){
+				fprintf(stderr, "Error: --framebuffer must be followed by double or float\n");
+				exit(1);
+			}
+			options.framebuffer = argv[++i];
+		}else if(strcmp(argv[i], "--planar") == 0){
+			options.planar = 1;
+		}else if(strcmp(argv[i], "--compile-scene") == 0){
+			options.compile_scene = 1;
+		}else if(strcmp(argv[i], "--stats") == 0){
+			options.stats = 1;
+		}else if(strcmp(argv[i], "--max-depth") == 0){
+			if(i + 1 >= c || !is_number(argv[i + 1])){
+				fprintf(stderr, "Error: --max-depth must be followed by a number\n");
+				exit(1);
+			}
+			options.max_depth = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "--min-weight") == 0){
+			if(i + 1 >= c || (options.min_weight = strtod(argv[i + 1], &end), *end != 0) || *argv[i + 1] == 0 ||
+				!(options.min_weight >= 0)){
+				fprintf(stderr, "Error: --min-weight must be followed by a number that is 0 or more\n");
+				exit(1);
+			}
+			i++;
+		}else if(strcmp(argv[i], "--wavefront") == 0){
+			options.wavefront = 1;
+		}else if(strcmp(argv[i], "--progressive") == 0){
+			options.progressive = 1;
+		}else if(strcmp(argv[i], "--animate") == 0){
+			if(i + 1 >= c || !has_extension(argv[i + 1], ".json")){
+				fprintf(stderr, "Error: --animate must be followed by a .json keyframe file\n");
+				exit(1);
+			}
+			options.animate = argv[++i];
+		}else if(strcmp(argv[i], "--serve") == 0){
+			if(i + 1 >= c){
+				fprintf(stderr, "Error: --serve must be followed by the path of a socket\n");
+				exit(1);
+			}
+			options.serve = argv[++i];
+		}else if(strcmp(argv[i], "--region") == 0){
+			if(i + 4 >= c || !is_number(argv[i + 1]) || !is_number(argv[i + 2]) || !is_number(argv[i + 3]) || !is_number(argv[i + 4])){
+				fprintf(stderr, "Error: --region must be followed by four numbers, x0 y0 x1 y1\n");
+				exit(1);
+			}
+			options.region.x0 = atoi(argv[++i]);
+			options.region.y0 = atoi(argv[++i]);
+			options.region.x1 = atoi(argv[++i]);
+			options.region.y1 = atoi(argv[++i]);
+			if(options.region.x0 >= options.region.x1 || options.region.y0 >= options.region.y1){
+				fprintf(stderr, "Error: --region must not be empty\n");
+				exit(1);
+			}
+		}else if(strcmp(argv[i], "--merge") == 0){
+			options.merge = 1;
+		}else if(strcmp(argv[i], "--light-cutoff") == 0){
+			if(i + 1 >= c || (options.light_cutoff = strtod(argv[i + 1], &end), *end != 0) || *argv[i + 1] == 0 ||
+				!(options.light_cutoff >= 0)){
+				fprintf(stderr, "Error: --light-cutoff must be followed by a number that is 0 or more\n");
+				exit(1);
+			}
+			i++;
+		}else if(strcmp(argv[i], "--diff") == 0){
+			if(i + 1 >= c || !is_number(argv[i + 1])){
+				fprintf(stderr, "Error: --diff must be followed by the largest channel difference to allow\n");
+				exit(1);
+			}
+			options.diff = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "--aa") == 0){
+			if(i + 2 >= c || !is_number(argv[i + 1]) || !is_number(argv[i + 2]) || atoi(argv[i + 1]) < 1 ||
+				atoi(argv[i + 1]) > 16 || atoi(argv[i + 2]) < 1 || atoi(argv[i + 2]) > 16){
+				fprintf(stderr, "Error: --aa must be followed by two sample counts between 1 and 16\n");
+				exit(1);
+			}
+			options.aa_min = atoi(argv[++i]);
+			options.aa_max = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "--aa-threshold") == 0){
+			if(i + 1 >= c || (options.aa_threshold = strtod(argv[i + 1], &end), *end != 0) || *argv[i + 1] == 0 ||
+				!(options.aa_threshold >= 0)){
+				fprintf(stderr, "Error: --aa-threshold must be followed by a number that is 0 or more\n");
+				exit(1);
+			}
+			i++;
+		}else if(strncmp(argv[i], "--", 2) == 0){
+			fprintf(stderr, "Error: Unknown option \"%s\"\n", argv[i]);
+			exit(1);
+		}else{
+			argv[arg_count++] = argv[i];
+		}
+	}
+	c = arg_count;
+	i = 0;
+	
+	if(options.progressive && (options.aa_min > 1 || options.aa_max > 1)){
+		fprintf(stderr, "Error: --aa and --progressive can not be used together\n");
+		exit(1);
+	}
+	if(options.animate != NULL && options.progressive){
+		fprintf(stderr, "Error: --animate and --progressive can not be used together\n");
+		exit(1);
+	}
+	if(options.serve != NULL){	//Scenes and image sizes come in with each request
+		if(c != 1){
+			fprintf(stderr, "Error: --serve does not take a width, height, scene or output file\n");
+			exit(1);
+		}
+		return c;
+	}
+	if(options.diff >= 0){	//Comparing takes the expected and the actual image
+		if(c != 3 || !has_extension(argv[1], ".ppm") || !has_extension(argv[2], ".ppm")){
+			fprintf(stderr, "Error: --diff TOLERANCE must be followed by the expected and the actual .ppm file\n");
+			exit(1);
+		}
+		return c;
+	}
+	if(options.merge){	//Merging takes the output .ppm file and the parts to stitch into it
+		if(c < 3 || !has_extension(argv[1], ".ppm")){
+			fprintf(stderr, "Error: --merge must be followed by an output .ppm file and the .ppm files to merge into it\n");
+			exit(1);
+		}
+		return c;
+	}
+	if(options.compile_scene){	//Compiling a scene only takes the input .json (or .rscn) and output .rscn files
+		if(c != 3 || (!has_extension(argv[1], ".json") && !has_extension(argv[1], ".rscn")) || !has_extension(argv[2], ".rscn")){
+			fprintf(stderr, "Error: --compile-scene must be followed by an input .json or .rscn file and an output .rscn file\n");
+			exit(1);
+		}
+		return c;
+	}
+	
 	if(c != 5){	//Ensure that five arguments are passed in through command line
 		fprintf(stderr, "Error: Incorrect amount of arguments\n");
 		exit(1);
@@ -594,13 +1377,18 @@ void argument_checker(int c, char** argv){	//Check input arguments for validity
 		j++;
 	}
 	
-	periodPointer = strrchr(argv[3], '.');	//Ensure that the input scene file has an extension .json
+	if(options.region.x1 > atoi(argv[1]) || options.region.y1 > atoi(argv[2])){
+		fprintf(stderr, "Error: --region must lie inside the image\n");
+		exit(1);
+	}
+	
+	periodPointer = strrchr(argv[3], '.');	//Ensure that the input scene file has an extension .json or .rscn
 	if(periodPointer == NULL){
 		fprintf(stderr, "Error: Input scene file does not have a file extension\n");
 		exit(1);
 	}
-	if(strcmp(periodPointer, ".json") != 0){
-		fprintf(stderr, "Error: Input scene file is not of type JSON\n");
+	if(strcmp(periodPointer, ".json") != 0 && strcmp(periodPointer, ".rscn") != 0){
+		fprintf(stderr, "Error: Input scene file is not of type JSON or RSCN\n");
 		exit(1);
 	}
 	
@@ -613,28 +1401,41 @@ void argument_checker(int c, char** argv){	//Check input arguments for validity
 		fprintf(stderr, "Error: Output picture file is not of type PPM\n");
 		exit(1);
 	}
+	return c;
 }
 
-double sphere_intersection(double* Ro, double* Rd, double* C, double radius){ //Calculates the solutions to a sphere intersection
+void ray_constants(Ray_constants* ray, double* Ro, double* Rd){	//Compute the sphere quadratic terms that only depend on the ray
+	int i;
+	for(i = 0; i < 3; i++){
+		ray->d[i] = 2*Rd[i];
+		ray->p[i] = ray->d[i]*Ro[i];
+		ray->o[i] = sqr(Ro[i]);
+		ray->q[i] = 2*Ro[i];
+	}
+	ray->a2 = 2*(sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
+	ray->a4 = 4*(sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
+}
+
+double sphere_intersection(Ray_constants* ray, Sphere_constants* spheres, int i){ //Calculates the solutions to a sphere intersection
 	//Sphere equation is x^2 + y^2 + z^2 = r^2
 	//Parameterize: (x-Cx)^2 + (y-Cy)^2 + (z-Cz)^2 - r^2 = 0
 	//Substitute with ray:
 	//(Rox + t*Rdx - Cx)^2 + (Roy + t*Rdy - Cy)^2 + (Roz + t*Rdz - Cz)^2 - r^2 = 0
 	//Solve for t:
-	//a = Rdx^2 + Rdy^2 + Rdz^2
-	double a = sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]);
+	//a = Rdx^2 + Rdy^2 + Rdz^2, which ray_constants() stores as 2a and 4a
 	//b = (2RdxRox - 2RdxCx) + (2RdyRoy - 2RdyCy) + (2RdzRoz - 2RdzCz)
-	double b = (2*Rd[0]*Ro[0] - 2*Rd[0]*C[0]) + (2*Rd[1]*Ro[1] - 2*Rd[1]*C[1]) + (2*Rd[2]*Ro[2] - 2*Rd[2]*C[2]);
+	double b = (ray->p[0] - ray->d[0]*spheres->x[i]) + (ray->p[1] - ray->d[1]*spheres->y[i]) + (ray->p[2] - ray->d[2]*spheres->z[i]);
 	//c = (Rox^2 - 2RoxCx + Cx^2) + (Roy^2 - 2RoyCy + Cy^2) + (Roz^2 - 2RozCz + Cz^2) - r^2
-	double c = (sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0])) + (sqr(Ro[1]) - 2*Ro[1]*C[1] + sqr(C[1])) + (sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2])) - sqr(radius);
+	double c = (ray->o[0] - ray->q[0]*spheres->x[i] + spheres->x2[i]) + (ray->o[1] - ray->q[1]*spheres->y[i] + spheres->y2[i]) +
+				(ray->o[2] - ray->q[2]*spheres->z[i] + spheres->z2[i]) - spheres->r2[i];
 	
 	double t0;
 	double t1;
-	double det = sqr(b) - 4*a*c;
+	double det = sqr(b) - ray->a4*c;
 	if(det < 0) return 0;	//If there are no real solutions return 0
 	
-	t0 = (-b - sqrt(det))/(2*a);	//Calculate both solutions
-	t1 = (-b + sqrt(det))/(2*a);
+	t0 = (-b - sqrt(det))/ray->a2;	//Calculate both solutions
+	t1 = (-b + sqrt(det))/ray->a2;
 	if(t0 <= 0 && t1 <= 0) return 0; //If both solutions are less than 0, return 0
 	if(t0 <= 0 && t1 > 0) return t1; //If only t1 is greater than 0, return t1
 	if(t1 <= 0 && t0 > 0) return t0; //If only t0 is greater than 0, return t0
@@ -645,7 +1446,7 @@ double sphere_intersection(double* Ro, double* Rd, double* C, double radius){ //
 	
 }
 
-double special_sphere_intersection(double* Ro, double* Rd, double* C, double radius){ //Calculates the solutions to a sphere intersection
+double special_sphere_intersection(double* Ro, double* Rd, double* C, double radius2){ //Calculates the solutions to a sphere of radius sqrt(radius2)
 	//Sphere equation is x^2 + y^2 + z^2 = r^2
 	//Parameterize: (x-Cx)^2 + (y-Cy)^2 + (z-Cz)^2 - r^2 = 0
 	//Substitute with ray:
@@ -656,7 +1457,7 @@ double special_sphere_intersection(double* Ro, double* Rd, double* C, double rad
 	//b = (2RdxRox - 2RdxCx) + (2RdyRoy - 2RdyCy) + (2RdzRoz - 2RdzCz)
 	double b = (2*Rd[0]*Ro[0] - 2*Rd[0]*C[0]) + (2*Rd[1]*Ro[1] - 2*Rd[1]*C[1]) + (2*Rd[2]*Ro[2] - 2*Rd[2]*C[2]);
 	//c = (Rox^2 - 2RoxCx + Cx^2) + (Roy^2 - 2RoyCy + Cy^2) + (Roz^2 - 2RozCz + Cz^2) - r^2
-	double c = (sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0])) + (sqr(Ro[1]) - 2*Ro[1]*C[1] + sqr(C[1])) + (sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2])) - sqr(radius);
+	double c = (sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0])) + (sqr(Ro[1]) - 2*Ro[1]*C[1] + sqr(C[1])) + (sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2])) - radius2;
 	
 	double t0;
 	double t1;
@@ -687,15 +1488,30 @@ double plane_intersection(double* Ro, double* Rd, double* C, double* N){ //Calcu
 	return 0;	//else just return 0
 }
 
-double fang(double a0, double theta, double* vO, double* vL){	//Return angular attenuation value
+double whole_power(double x, int n){	//Return x to the power n by repeated squaring, n must not be negative
+	double result = 1;
+	while(n > 0){
+		if(n & 1) result *= x;
+		x *= x;
+		n >>= 1;
+	}
+	return result;
+}
+
+int whole_exponent(double exponent){	//Return exponent if whole_power() can raise to it, otherwise -1 so pow() is used
+	if(exponent < 0 || exponent > MAX_WHOLE_EXPONENT || exponent != (int)exponent) return -1;
+	return (int)exponent;
+}
+
+double fang(double a0, int whole_a0, double cos_theta, double* vO, double* vL){	//Return angular attenuation value of a spotlight
 	//vO is vector pointing from the light to the object
 	//vL is the direction of the light
-	//theta and a0 have to do with spotlight width and drop-off
+	//cos_theta and a0 have to do with spotlight width and drop-off, lights that are not spotlights never call this
 	double cos_phi = vO[0]*vL[0] + vO[1]*vL[1] + vO[2]*vL[2];
-	if(theta == 0 || a0 == 0) return 1;	//If we aren't using spotlights, we can just return 1
-	if(cos_phi < cos(theta)){
+	if(cos_phi < cos_theta){
 		return 0;
 	}
+	if(whole_a0 >= 0) return whole_power(cos_phi, whole_a0);
 	return pow(cos_phi, a0);
 }
 
@@ -706,9 +1522,10 @@ double frad(double a0, double a1, double a2, double distance){	//Return radial a
 	return 1/denominator;	//If everything goes smoothly, return the real radial attenuation value
 }
 
-double* diffuse(double* L, double* N, double* Cd, double* Ci){	//Return diffuse color value
+Vector diffuse(double* L, double* N, double* Cd, double* Ci){	//Return diffuse color value
 	//Cd is diffuse color, and Ci is light color
-	double* diffused_color = malloc(sizeof(double)*3);
+	Vector diffused;
+	double* diffused_color = diffused.v;
 	//Calculate diffuse color values
 	double dot_product_L_N = L[0] * N[0] + L[1] * N[1] + L[2] * N[2];
 	diffused_color[0] = (dot_product_L_N)*Cd[0]*Ci[0];
@@ -717,13 +1534,16 @@ double* diffuse(double* L, double* N, double* Cd, double* Ci){	//Return diffuse
 	if(diffused_color[0] < 0) diffused_color[0] = 0;	//Diffuse colors cannot be negative
 	if(diffused_color[1] < 0) diffused_color[1] = 0;
 	if(diffused_color[2] < 0) diffused_color[2] = 0;
-	return diffused_color;		//Return diffuse color
+	return diffused;		//Return diffuse color
 }
 
-double* specular(double* R, double* V, double* Cs, double* Ci, double* N, double* L){	//Return specular color value
-	double* speculared_color = malloc(sizeof(double)*3);
+//Return specular color value, whole_ns is ns if it is a whole number, otherwise -1
+Vector specular(double* R, double* V, double* Cs, double* Ci, double* N, double* L, double ns, int whole_ns){
+	Vector speculared;
+	double* speculared_color = speculared.v;
 	double dot_product_R_V = R[0]*V[0] + R[1]*V[1] + R[2]*V[2];
 	double dot_product_N_L = N[0]*L[0] + N[1]*L[1] + N[2]*L[2];
+	double highlight;
 	if(dot_product_N_L <= 0 || dot_product_R_V <= 0){
 		//If our object normal and vector from the light to object dot product is 0 or negative,
 		//or if the dot product of our reflected and camera vector are 0
@@ -731,33 +1551,36 @@ double* specular(double* R, double* V, double* Cs, double* Ci, double* N, double
 		speculared_color[0] = 0;
 		speculared_color[1] = 0;
 		speculared_color[2] = 0;
-		return speculared_color;
+		return speculared;
 	}
-	//Calculate specular color, with ns value hardcoded to 20
-	speculared_color[0] = pow(dot_product_R_V, 20)*Cs[0]*Ci[0];
-	speculared_color[1] = pow(dot_product_R_V, 20)*Cs[1]*Ci[1];
-	speculared_color[2] = pow(dot_product_R_V, 20)*Cs[2]*Ci[2];
+	//Calculate specular color, the power is the same for every channel
+	highlight = whole_ns >= 0 ? whole_power(dot_product_R_V, whole_ns) : pow(dot_product_R_V, ns);
+	speculared_color[0] = highlight*Cs[0]*Ci[0];
+	speculared_color[1] = highlight*Cs[1]*Ci[1];
+	speculared_color[2] = highlight*Cs[2]*Ci[2];
 	if(speculared_color[0] < 0) speculared_color[0] = 0;	//Specular color may not be negative
 	if(speculared_color[1] < 0) speculared_color[1] = 0;
 	if(speculared_color[2] < 0) speculared_color[2] = 0;
-	return speculared_color;	//Return specular color
+	return speculared;	//Return specular color
 }
 
 double calculate_distance(double* input_vector){	//Calculate the magnitude/distance of the input vector
 	return sqrt(sqr(input_vector[0]) + sqr(input_vector[1]) + sqr(input_vector[2]));
 }
 
-double* reflect(double* L, double* N){	//Reflect vector L across a normal N
-	double* reflect_vector = malloc(sizeof(double)*3);
+Vector reflect(double* L, double* N){	//Reflect vector L across a normal N
+	Vector reflected;
+	double* reflect_vector = reflected.v;
 	double dot_product_L_N = (L[0] * N[0]) + (L[1] * N[1]) + (L[2] * N[2]);
 	reflect_vector[0] = L[0] - 2*dot_product_L_N * N[0];
 	reflect_vector[1] = L[1] - 2*dot_product_L_N * N[1];
 	reflect_vector[2] = L[2] - 2*dot_product_L_N * N[2];
-	return reflect_vector;
+	return reflected;
 }
 
-double* refract(double* Rd, double* N, double ior){  //Use Snell's Law to find refracted ray
-	double* refract_vector = malloc(sizeof(double)*3);
+Vector refract(double* Rd, double* N, double ior){  //Use Snell's Law to find refracted ray
+	Vector refracted;
+	double* refract_vector = refracted.v;
 	double refract_sin;
 	double refract_cos;
 	double cross_product_distance;
@@ -781,399 +1604,1867 @@ double* refract(double* Rd, double* N, double ior){  //Use Snell's Law to find r
 	refract_vector[2] = -N[2]*refract_cos + b[2]*refract_sin;
 	normalize(refract_vector);
 	
-	return refract_vector;
+	return refracted;
 }
 
 double simplify(double input){	//Simplify number to the thousandth decimal place
 	return round(input*1000)/1000;
 }
 
-Tuple* shoot(Object** object_array, int object_counter, double* Ro, double* Rd){	//Find object intersections
-	Tuple* intersection = malloc(sizeof(Tuple));
-	int parse_count = 1;
-	double best_t = INFINITY;
-	int best_index = -1;
-	double t = 0;
+double surface_area(double* min, double* max){	//Return the surface area of a bounding box, used as the SAH probability of a ray hitting it
+	double dx = max[0] - min[0];
+	double dy = max[1] - min[1];
+	double dz = max[2] - min[2];
+	return 2*(dx*dy + dy*dz + dz*dx);
+}
+
+void grow_box(double* min, double* max, double* input_min, double* input_max){	//Grow the box min/max until it contains the input box
+	int i;
+	for(i = 0; i < 3; i++){
+		if(input_min[i] < min[i]) min[i] = input_min[i];
+		if(input_max[i] > max[i]) max[i] = input_max[i];
+	}
+}
+
+//Recursively build the node at node_index over the spheres in bvh->indices[start] to bvh->indices[start + count - 1]
+//bounds holds each sphere's box as min xyz then max xyz, and centroids holds each sphere's center, both by object index
+void build_bvh_node(Bvh* bvh, int node_index, int start, int count, int depth, double* bounds, double* centroids){
+	Bvh_node* node = &bvh->nodes[node_index];
+	double centroid_min[3] = {INFINITY, INFINITY, INFINITY};
+	double centroid_max[3] = {-INFINITY, -INFINITY, -INFINITY};
+	double bin_min[BVH_BINS][3];
+	double bin_max[BVH_BINS][3];
+	int bin_count[BVH_BINS];
+	double left_area[BVH_BINS];
+	int left_count[BVH_BINS];
+	double box_min[3];
+	double box_max[3];
+	double best_cost = INFINITY;
+	double cost;
+	double scale;
+	int best_axis = -1;
+	int best_split = 0;
+	int axis, i, j, bin, right_count, middle;
 	
-	while(parse_count < object_counter + 1){	//Iterate through object array and test for intersections
-		if(object_array[parse_count]->kind == 1){	//If sphere, test for sphere intersections
-			t = sphere_intersection(Ro, Rd, object_array[parse_count]->sphere.position,
-									object_array[parse_count]->sphere.radius);
-		}else if(object_array[parse_count]->kind == 2){	//If plane, test for a plane intersection
-			t = plane_intersection(Ro, Rd, object_array[parse_count]->plane.position,
-									object_array[parse_count]->plane.normal);
-		}else{
-			parse_count++;
-			continue;
+	node->min[0] = node->min[1] = node->min[2] = INFINITY;
+	node->max[0] = node->max[1] = node->max[2] = -INFINITY;
+	for(i = start; i < start + count; i++){	//Find the bounds of this node, and the bounds of the centers inside it
+		grow_box(node->min, node->max, &bounds[6*bvh->indices[i]], &bounds[6*bvh->indices[i] + 3]);
+		grow_box(centroid_min, centroid_max, &centroids[3*bvh->indices[i]], &centroids[3*bvh->indices[i]]);
+	}
+	node->start = start;
+	node->count = count;
+	node->axis = 0;
+	if(count <= BVH_LEAF_SIZE) return;
+	
+	if(depth < BVH_MAX_DEPTH){	//Find the cheapest split using the surface area heuristic over binned centroids
+		for(axis = 0; axis < 3; axis++){
+			if(centroid_max[axis] <= centroid_min[axis]) continue;	//Every center is in the same place along this axis
+			scale = BVH_BINS/(centroid_max[axis] - centroid_min[axis]);
+			for(j = 0; j < BVH_BINS; j++){
+				bin_count[j] = 0;
+				bin_min[j][0] = bin_min[j][1] = bin_min[j][2] = INFINITY;
+				bin_max[j][0] = bin_max[j][1] = bin_max[j][2] = -INFINITY;
+			}
+			for(i = start; i < start + count; i++){
+				bin = (int)((centroids[3*bvh->indices[i] + axis] - centroid_min[axis])*scale);
+				if(bin >= BVH_BINS) bin = BVH_BINS - 1;
+				bin_count[bin]++;
+				grow_box(bin_min[bin], bin_max[bin], &bounds[6*bvh->indices[i]], &bounds[6*bvh->indices[i] + 3]);
+			}
+			
+			//Sweep from the left storing the area and count left of each split, then sweep back from the right
+			box_min[0] = box_min[1] = box_min[2] = INFINITY;
+			box_max[0] = box_max[1] = box_max[2] = -INFINITY;
+			j = 0;
+			for(bin = 0; bin < BVH_BINS - 1; bin++){
+				j += bin_count[bin];
+				grow_box(box_min, box_max, bin_min[bin], bin_max[bin]);
+				left_count[bin] = j;
+				left_area[bin] = j > 0 ? surface_area(box_min, box_max) : 0;
+			}
+			box_min[0] = box_min[1] = box_min[2] = INFINITY;
+			box_max[0] = box_max[1] = box_max[2] = -INFINITY;
+			right_count = 0;
+			for(bin = BVH_BINS - 1; bin > 0; bin--){
+				right_count += bin_count[bin];
+				grow_box(box_min, box_max, bin_min[bin], bin_max[bin]);
+				if(left_count[bin - 1] == 0 || right_count == 0) continue;
+				cost = left_area[bin - 1]*left_count[bin - 1] + surface_area(box_min, box_max)*right_count;
+				if(cost < best_cost){
+					best_cost = cost;
+					best_axis = axis;
+					best_split = bin;
+				}
+			}
 		}
 		
-		if(t < best_t && t > .0001){	//Store object index with the closest intersection
-			best_t = t;					//Store distance to closest intersection
-			best_index = parse_count;
+		//Compare against the cost of just testing every sphere in a leaf
+		best_cost = BVH_TRAVERSAL_COST + best_cost/surface_area(node->min, node->max);
+		if(best_axis != -1 && best_cost >= count && count <= BVH_MAX_LEAF_SIZE) return;
+	}
+	
+	if(best_axis != -1){	//Partition indices so that every sphere left of the split bin comes first
+		scale = BVH_BINS/(centroid_max[best_axis] - centroid_min[best_axis]);
+		i = start;
+		j = start + count - 1;
+		while(i <= j){
+			bin = (int)((centroids[3*bvh->indices[i] + best_axis] - centroid_min[best_axis])*scale);
+			if(bin >= BVH_BINS) bin = BVH_BINS - 1;
+			if(bin < best_split){
+				i++;
+			}else{
+				middle = bvh->indices[i];
+				bvh->indices[i] = bvh->indices[j];
+				bvh->indices[j--] = middle;
+			}
 		}
-		parse_count++;
+		middle = i - start;
+		node->axis = best_axis;
+	}else{	//If no split was found (all centers identical, or we are too deep), split the spheres in half by count
+		middle = count/2;
 	}
-	intersection->best_index = best_index;
-	intersection->best_t = best_t;
-	return intersection;
+	
+	node->start = bvh->node_count;	//Reserve both children next to each other
+	node->count = 0;
+	bvh->node_count += 2;
+	build_bvh_node(bvh, node->start, start, middle, depth + 1, bounds, centroids);
+	build_bvh_node(bvh, bvh->nodes[node_index].start + 1, start + middle, count - middle, depth + 1, bounds, centroids);
 }
 
-//Forward declaration of render_light for the functions get_reflect_color() and get_refract_color()
-double* render_light(Object**, int, double, int, double*, double*, int);
-
-double* get_reflect_color(Object** object_array, int object_counter, int best_index,  //Calculate object reflections
-							double* Ron, double* Rd, double* N, int layer){
-	double* reflected_color;
-	double* R1;
-	Tuple* intersection;
-	R1 = reflect(Rd, N);	//Reflect ray coming from camera to find reflection
-	normalize(R1);
-	
-	intersection = shoot(object_array, object_counter, Ron, R1);	//Find intersection of this reflected ray
-	if(intersection->best_t > 0 && intersection->best_t != INFINITY){	//If the intersection is valid, calculate reflected light
-		reflected_color = render_light(object_array, object_counter, intersection->best_t,
-										intersection->best_index, Ron, R1, layer + 1);
-		if(object_array[best_index]->kind == 1){
-			reflected_color[0] = reflected_color[0]*object_array[best_index]->sphere.reflectivity;
-			reflected_color[1] = reflected_color[1]*object_array[best_index]->sphere.reflectivity;
-			reflected_color[2] = reflected_color[2]*object_array[best_index]->sphere.reflectivity;
-		}
-		else if(object_array[best_index]->kind == 2){
-			reflected_color[0] = reflected_color[0]*object_array[best_index]->plane.reflectivity;
-			reflected_color[1] = reflected_color[1]*object_array[best_index]->plane.reflectivity;
-			reflected_color[2] = reflected_color[2]*object_array[best_index]->plane.reflectivity;
-		}
-	}else{	//If no intersection found, return black
-		reflected_color = malloc(sizeof(double)*3);
-		reflected_color[0] = 0;
-		reflected_color[1] = 0;
-		reflected_color[2] = 0;
-	}
-	free(intersection);
-	free(R1);
-	return reflected_color;
-}
-
-double* get_refract_color(Object** object_array, int object_counter, int best_index,  //Calculate object refraction
-							double* Ron, double* Rd, double* N, int layer){
-	double Ron1[3];
-	double N1[3];
-	double* refracted_vector;
-	double* refracted_vector1;
-	double* refracted_color = NULL;
-	Tuple* intersection;
-	double t = 0;
-	if(object_array[best_index]->kind == 1){//If the object is a sphere, two refractions must be performed
-		refracted_vector1 = refract(Rd, N, object_array[best_index]->sphere.ior);	//Calculate first refraction
-		//Find next sphere intersection with refracted vector
-		t = special_sphere_intersection(Ron, refracted_vector1, object_array[best_index]->sphere.position, object_array[best_index]->sphere.radius);
-		if(t <= .0001 || t == INFINITY){	//If no intersection found, just use our current vector as final refracted vector
-			refracted_vector = refracted_vector1;
-		}else{	//If interesection is found, calculate a new refracted vector with our previous refracted vector
-			Ron1[0] = Ron[0] + refracted_vector1[0]*t;
-			Ron1[1] = Ron[1] + refracted_vector1[1]*t;
-			Ron1[2] = Ron[2] + refracted_vector1[2]*t;
-			N1[0] = object_array[best_index]->sphere.position[0] - Ron1[0];
-			N1[1] = object_array[best_index]->sphere.position[1] - Ron1[1];
-			N1[2] = object_array[best_index]->sphere.position[2] - Ron1[2];
-			normalize(N1);
-			refracted_vector = refract(refracted_vector1, N1, object_array[best_index]->sphere.ior);
-			free(refracted_vector1);
-		}
-		
-		//Find closest object intersection with our new final refracted vector
-		intersection = shoot(object_array, object_counter, Ron1, refracted_vector);
-		if(intersection->best_t > 0 && intersection->best_t != INFINITY){	//If valid intersection found, calculate refracted color
-			refracted_color = render_light(object_array, object_counter, intersection->best_t,
-											intersection->best_index, Ron1, refracted_vector, layer+1);
-			refracted_color[0] = refracted_color[0]*object_array[best_index]->sphere.refractivity;
-			refracted_color[1] = refracted_color[1]*object_array[best_index]->sphere.refractivity;
-			refracted_color[2] = refracted_color[2]*object_array[best_index]->sphere.refractivity;
-		}
-		free(intersection);
-		free(refracted_vector);
-	}
-	else if(object_array[best_index]->kind == 2){	//If object is a plane, we need to calculate for refraction only once
-		refracted_vector = refract(Rd, N, object_array[best_index]->plane.ior);
-		
-		//Find object intersection with our refracted vector
-		intersection = shoot(object_array, object_counter, Ron, refracted_vector);
-		if(intersection->best_t > 0 && intersection->best_t != INFINITY){	//If intersection is valid, calculate refracted color
-			refracted_color = render_light(object_array, object_counter, intersection->best_t,
-											intersection->best_index, Ron, refracted_vector, layer+1);
-			refracted_color[0] = refracted_color[0]*object_array[best_index]->plane.refractivity;
-			refracted_color[1] = refracted_color[1]*object_array[best_index]->plane.refractivity;
-			refracted_color[2] = refracted_color[2]*object_array[best_index]->plane.refractivity;
-		}
-		free(intersection);
-		free(refracted_vector);
+void sphere_bounds(Sphere_array* spheres, int i, double* min, double* max){	//Find the bounding box of sphere i
+	double center[3] = {spheres->x[i], spheres->y[i], spheres->z[i]};
+	double radius = fabs(spheres->radius[i]);
+	double pad;
+	int j;
+	for(j = 0; j < 3; j++){	//Pad the box slightly, so rounding in sphere_intersection() never lands a hit outside of it
+		pad = 1e-9*(radius + fabs(center[j])) + 1e-12;
+		min[j] = center[j] - radius - pad;
+		max[j] = center[j] + radius + pad;
 	}
+}
+
+void store_sphere_constants(Bvh* bvh, Sphere_array* spheres){	//Fill in the quadratic terms of every sphere, in tree order
+	int i, j;
+	for(i = 0; i < spheres->count; i++){
+		j = bvh->indices[i];
+		bvh->constants.x[i] = spheres->x[j];
+		bvh->constants.y[i] = spheres->y[j];
+		bvh->constants.z[i] = spheres->z[j];
+		bvh->constants.x2[i] = sqr(spheres->x[j]);
+		bvh->constants.y2[i] = sqr(spheres->y[j]);
+		bvh->constants.z2[i] = sqr(spheres->z[j]);
+		bvh->constants.r2[i] = sqr(spheres->radius[j]);
+	}
+}
+
+void build_bvh(Scene* scene){	//Build the bounding volume hierarchy over the spheres of our scene
+	Bvh* bvh = &scene->bvh;
+	Sphere_array* spheres = &scene->spheres;
+	double* bounds = malloc(sizeof(double)*6*spheres->count);
+	double* centroids = malloc(sizeof(double)*3*spheres->count);
+	int i;
 	
+	bvh->indices = malloc(sizeof(int)*spheres->count);
+	for(i = 0; i < spheres->count; i++){
+		centroids[3*i] = spheres->x[i];
+		centroids[3*i + 1] = spheres->y[i];
+		centroids[3*i + 2] = spheres->z[i];
+		sphere_bounds(spheres, i, &bounds[6*i], &bounds[6*i + 3]);
+		bvh->indices[i] = i;
+	}
 	
-	if(refracted_color == NULL){	//If no refracted intersections are found, return black
-		refracted_color = malloc(sizeof(double)*3);
-		refracted_color[0] = 0;
-		refracted_color[1] = 0;
-		refracted_color[2] = 0;
+	bvh->nodes = malloc(sizeof(Bvh_node)*(2*spheres->count + 1));
+	bvh->node_count = 0;
+	if(spheres->count > 0){
+		bvh->node_count = 1;
+		build_bvh_node(bvh, 0, 0, spheres->count, 0, bounds, centroids);
 	}
+	free(bounds);
+	free(centroids);
 	
-	return refracted_color;
+	//Store each sphere's quadratic terms in tree order, so a leaf's spheres can be loaded straight into vector registers
+	bvh->constants.x = calloc(spheres->count + SIMD_PADDING, sizeof(double));
+	bvh->constants.y = calloc(spheres->count + SIMD_PADDING, sizeof(double));
+	bvh->constants.z = calloc(spheres->count + SIMD_PADDING, sizeof(double));
+	bvh->constants.x2 = calloc(spheres->count + SIMD_PADDING, sizeof(double));
+	bvh->constants.y2 = calloc(spheres->count + SIMD_PADDING, sizeof(double));
+	bvh->constants.z2 = calloc(spheres->count + SIMD_PADDING, sizeof(double));
+	bvh->constants.r2 = calloc(spheres->count + SIMD_PADDING, sizeof(double));
+	store_sphere_constants(bvh, spheres);
 }
 
-//Calculate color values using lights
-double* render_light(Object** object_array, int object_counter, double best_t,
-						int best_index, double* Ro, double* Rd, int layer){
-	double t = 0;
-	int parse_count = 1;
-	int parse_count1 = 1;
-	double Ron[3];
-	double Rdn[3];
-	double* color = malloc(sizeof(double)*3);
-	double* reflected_color;
-	double* refracted_color;
-	double* diffused_color;
-	double* speculared_color;
-	double N[3];
-	double L[3];
-	double* R;
-	double V[3];
-	double distance_from_light;
-	Tuple* intersection;
-	double portion_not_refracted_reflected = 0;
-	double radial_attenuation;
-	double angular_attenuation;
-	
+//Update the BVH after spheres have moved, keeping its tree and only recomputing the boxes and the sphere constants
+//Children are always stored after their parent, so walking the nodes backwards finishes every child before its parent
+void refit_bvh(Scene* scene){
+	Bvh* bvh = &scene->bvh;
+	Bvh_node* node;
+	double min[3];
+	double max[3];
+	int i, j;
 	
-	Ron[0] = best_t * Rd[0] + Ro[0];	//Calculate the intersection point of the object we hit
-	Ron[1] = best_t * Rd[1] + Ro[1];
-	Ron[2] = best_t * Rd[2] + Ro[2];
-			
-	parse_count = 1;
-	parse_count1 = 1;
-	
-	color[0] = 0;	//Set color value to black (for now)
-	color[1] = 0;
-	color[2] = 0;
+	store_sphere_constants(bvh, &scene->spheres);
+	for(i = bvh->node_count - 1; i >= 0; i--){
+		node = &bvh->nodes[i];
+		node->min[0] = node->min[1] = node->min[2] = INFINITY;
+		node->max[0] = node->max[1] = node->max[2] = -INFINITY;
+		if(node->count > 0){
+			for(j = node->start; j < node->start + node->count; j++){
+				sphere_bounds(&scene->spheres, bvh->indices[j], min, max);
+				grow_box(node->min, node->max, min, max);
+			}
+		}else{
+			grow_box(node->min, node->max, bvh->nodes[node->start].min, bvh->nodes[node->start].max);
+			grow_box(node->min, node->max, bvh->nodes[node->start + 1].min, bvh->nodes[node->start + 1].max);
+		}
+	}
+}
+
+static inline int ray_box(double* Ro, double* inverse_Rd, double* min, double* max, double t_max){	//Return 1 if the ray enters the box before t_max
+	double t_near = 0;
+	double t_far = t_max;
+	double t0, t1, temp;
+	int i;
+	for(i = 0; i < 3; i++){	//Clip the ray against each pair of slabs, NaNs from zero directions fail every test and are ignored
+		t0 = (min[i] - Ro[i])*inverse_Rd[i];
+		t1 = (max[i] - Ro[i])*inverse_Rd[i];
+		if(t0 > t1){
+			temp = t0;
+			t0 = t1;
+			t1 = temp;
+		}
+		if(t0 > t_near) t_near = t0;
+		if(t1 < t_far) t_far = t1;
+		if(t_near > t_far) return 0;
+	}
+	return 1;
+}
+
+//Keep primitive index as the best hit if it lies past t_min and is nearer than best_t, equal distances go to the lower index
+static inline void keep_nearest(double t, int index, double t_min, int exclude, double* best_t, int* best_index){
+	if(index != exclude && t > t_min && (t < *best_t || (t == *best_t && index < *best_index))){
+		*best_t = t;
+		*best_index = index;
+	}
+}
+
+void sphere_kernel_scalar(Ray_constants* ray, Bvh* bvh, int start, int count, double t_min, int exclude,
+							double* best_t, int* best_index){	//Test each sphere on its own, used when no vector unit is available
+	int i;
+	for(i = start; i < start + count; i++){
+		keep_nearest(sphere_intersection(ray, &bvh->constants, i), bvh->indices[i], t_min, exclude, best_t, best_index);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+//The vector kernels evaluate exactly the same operations as sphere_intersection(), in the same order, for several
+//spheres at once, so they give bit-identical distances. Lanes are then filtered and handed to keep_nearest() in order.
+
+void sphere_kernel_sse2(Ray_constants* ray, Bvh* bvh, int start, int count, double t_min, int exclude,
+							double* best_t, int* best_index){	//Test two spheres per instruction
+	Sphere_constants* spheres = &bvh->constants;
+	__m128d d0 = _mm_set1_pd(ray->d[0]), d1 = _mm_set1_pd(ray->d[1]), d2 = _mm_set1_pd(ray->d[2]);
+	__m128d p0 = _mm_set1_pd(ray->p[0]), p1 = _mm_set1_pd(ray->p[1]), p2 = _mm_set1_pd(ray->p[2]);
+	__m128d o0 = _mm_set1_pd(ray->o[0]), o1 = _mm_set1_pd(ray->o[1]), o2 = _mm_set1_pd(ray->o[2]);
+	__m128d q0 = _mm_set1_pd(ray->q[0]), q1 = _mm_set1_pd(ray->q[1]), q2 = _mm_set1_pd(ray->q[2]);
+	__m128d a2 = _mm_set1_pd(ray->a2), a4 = _mm_set1_pd(ray->a4);
+	__m128d zero = _mm_setzero_pd(), sign = _mm_set1_pd(-0.0), minimum = _mm_set1_pd(t_min);
+	__m128d x, y, z, b, c, det, root, t0, t1, v0, v1, t;
+	double lanes[2];
+	int i, lane, mask;
+	
+	for(i = start; i < start + count; i += 2){
+		x = _mm_loadu_pd(spheres->x + i);
+		y = _mm_loadu_pd(spheres->y + i);
+		z = _mm_loadu_pd(spheres->z + i);
+		b = _mm_add_pd(_mm_add_pd(_mm_sub_pd(p0, _mm_mul_pd(d0, x)), _mm_sub_pd(p1, _mm_mul_pd(d1, y))),
+						_mm_sub_pd(p2, _mm_mul_pd(d2, z)));
+		c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(
+				_mm_add_pd(_mm_sub_pd(o0, _mm_mul_pd(q0, x)), _mm_loadu_pd(spheres->x2 + i)),
+				_mm_add_pd(_mm_sub_pd(o1, _mm_mul_pd(q1, y)), _mm_loadu_pd(spheres->y2 + i))),
+				_mm_add_pd(_mm_sub_pd(o2, _mm_mul_pd(q2, z)), _mm_loadu_pd(spheres->z2 + i))),
+				_mm_loadu_pd(spheres->r2 + i));
+		det = _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(a4, c));
+		root = _mm_sqrt_pd(det);	//Negative determinants give NaN, which fails every comparison below
+		b = _mm_xor_pd(b, sign);
+		t0 = _mm_div_pd(_mm_sub_pd(b, root), a2);
+		t1 = _mm_div_pd(_mm_add_pd(b, root), a2);
+		v0 = _mm_cmpgt_pd(t0, zero);
+		v1 = _mm_cmpgt_pd(t1, zero);
+		//Pick the smaller positive solution, or 0 if neither is positive
+		t = _mm_or_pd(_mm_and_pd(v1, t1), _mm_andnot_pd(v1, zero));
+		t = _mm_or_pd(_mm_and_pd(v0, t0), _mm_andnot_pd(v0, t));
+		t = _mm_or_pd(_mm_and_pd(_mm_and_pd(v0, v1), _mm_min_pd(t0, t1)), _mm_andnot_pd(_mm_and_pd(v0, v1), t));
+		
+		mask = _mm_movemask_pd(_mm_and_pd(_mm_cmpgt_pd(t, minimum), _mm_cmple_pd(t, _mm_set1_pd(*best_t))));
+		if(mask == 0) continue;	//Nothing in this group can beat our best hit
+		_mm_storeu_pd(lanes, t);
+		for(lane = 0; lane < 2 && i + lane < start + count; lane++){
+			if(mask & (1 << lane)) keep_nearest(lanes[lane], bvh->indices[i + lane], t_min, exclude, best_t, best_index);
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+void sphere_kernel_avx2(Ray_constants* ray, Bvh* bvh, int start, int count, double t_min, int exclude,
+							double* best_t, int* best_index){	//Test four spheres per instruction
+	Sphere_constants* spheres = &bvh->constants;
+	__m256d d0 = _mm256_set1_pd(ray->d[0]), d1 = _mm256_set1_pd(ray->d[1]), d2 = _mm256_set1_pd(ray->d[2]);
+	__m256d p0 = _mm256_set1_pd(ray->p[0]), p1 = _mm256_set1_pd(ray->p[1]), p2 = _mm256_set1_pd(ray->p[2]);
+	__m256d o0 = _mm256_set1_pd(ray->o[0]), o1 = _mm256_set1_pd(ray->o[1]), o2 = _mm256_set1_pd(ray->o[2]);
+	__m256d q0 = _mm256_set1_pd(ray->q[0]), q1 = _mm256_set1_pd(ray->q[1]), q2 = _mm256_set1_pd(ray->q[2]);
+	__m256d a2 = _mm256_set1_pd(ray->a2), a4 = _mm256_set1_pd(ray->a4);
+	__m256d zero = _mm256_setzero_pd(), sign = _mm256_set1_pd(-0.0), minimum = _mm256_set1_pd(t_min);
+	__m256d x, y, z, b, c, det, root, t0, t1, v0, v1, t;
+	double lanes[4];
+	int i, lane, mask;
+	
+	for(i = start; i < start + count; i += 4){
+		x = _mm256_loadu_pd(spheres->x + i);
+		y = _mm256_loadu_pd(spheres->y + i);
+		z = _mm256_loadu_pd(spheres->z + i);
+		b = _mm256_add_pd(_mm256_add_pd(_mm256_sub_pd(p0, _mm256_mul_pd(d0, x)), _mm256_sub_pd(p1, _mm256_mul_pd(d1, y))),
+						_mm256_sub_pd(p2, _mm256_mul_pd(d2, z)));
+		c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(
+				_mm256_add_pd(_mm256_sub_pd(o0, _mm256_mul_pd(q0, x)), _mm256_loadu_pd(spheres->x2 + i)),
+				_mm256_add_pd(_mm256_sub_pd(o1, _mm256_mul_pd(q1, y)), _mm256_loadu_pd(spheres->y2 + i))),
+				_mm256_add_pd(_mm256_sub_pd(o2, _mm256_mul_pd(q2, z)), _mm256_loadu_pd(spheres->z2 + i))),
+				_mm256_loadu_pd(spheres->r2 + i));
+		det = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(a4, c));
+		root = _mm256_sqrt_pd(det);	//Negative determinants give NaN, which fails every comparison below
+		b = _mm256_xor_pd(b, sign);
+		t0 = _mm256_div_pd(_mm256_sub_pd(b, root), a2);
+		t1 = _mm256_div_pd(_mm256_add_pd(b, root), a2);
+		v0 = _mm256_cmp_pd(t0, zero, _CMP_GT_OQ);
+		v1 = _mm256_cmp_pd(t1, zero, _CMP_GT_OQ);
+		//Pick the smaller positive solution, or 0 if neither is positive
+		t = _mm256_blendv_pd(zero, t1, v1);
+		t = _mm256_blendv_pd(t, t0, v0);
+		t = _mm256_blendv_pd(t, _mm256_min_pd(t0, t1), _mm256_and_pd(v0, v1));
+		
+		mask = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(t, minimum, _CMP_GT_OQ),
+												_mm256_cmp_pd(t, _mm256_set1_pd(*best_t), _CMP_LE_OQ)));
+		if(mask == 0) continue;	//Nothing in this group can beat our best hit
+		_mm256_storeu_pd(lanes, t);
+		for(lane = 0; lane < 4 && i + lane < start + count; lane++){
+			if(mask & (1 << lane)) keep_nearest(lanes[lane], bvh->indices[i + lane], t_min, exclude, best_t, best_index);
+		}
+	}
+}
+#endif
+
+Sphere_kernel sphere_kernel = sphere_kernel_scalar;	//Chosen at startup by select_sphere_kernel()
+
+void select_sphere_kernel(void){	//Pick the widest sphere kernel this processor supports, unless --simd asked for a specific one
+	int avx2 = 0;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2");
+#endif
+	if(strcmp(options.simd, "scalar") == 0){
+		sphere_kernel = sphere_kernel_scalar;
+		return;
+	}
+#ifdef HAVE_X86_SIMD
+	if(strcmp(options.simd, "avx2") == 0 && !avx2){
+		fprintf(stderr, "Error: This processor does not support AVX2\n");
+		exit(1);
+	}
+	if(avx2 && strcmp(options.simd, "sse2") != 0){
+		sphere_kernel = sphere_kernel_avx2;
+	}else{
+		sphere_kernel = sphere_kernel_sse2;	//SSE2 is part of every x86-64 processor
+	}
+#else
+	if(strcmp(options.simd, "auto") != 0){
+		fprintf(stderr, "Error: SIMD kernels are not available on this processor\n");
+		exit(1);
+	}
+#endif
+}
+
+//Find the closest primitive hit further than t_min along the ray, skipping primitive number exclude (-1 skips nothing)
+//Equal distances go to the lower primitive number, so the result does not depend on traversal order
+void closest_hit(Scene* scene, double* Ro, double* Rd, double t_min, int exclude, Tuple* intersection){
+	Bvh* bvh = &scene->bvh;
+	Sphere_array* spheres = &scene->spheres;
+	Plane_array* planes = &scene->planes;
+	Bvh_node* node;
+	double C[3];
+	double N[3];
+	Ray_constants ray;
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	double inverse_Rd[3];
+	double best_t = INFINITY;
+	int best_index = -1;
+	double t = 0;
+	int index;
+	int i;
+	
+	for(i = 0; i < planes->count; i++){	//Planes are unbounded, so test every one of them
+		index = spheres->count + i;
+		if(index == exclude) continue;
+		thread_stats.plane_tests++;
+		C[0] = planes->x[i];
+		C[1] = planes->y[i];
+		C[2] = planes->z[i];
+		N[0] = planes->nx[i];
+		N[1] = planes->ny[i];
+		N[2] = planes->nz[i];
+		t = plane_intersection(Ro, Rd, C, N);
+		keep_nearest(t, index, t_min, exclude, &best_t, &best_index);
+	}
+	
+	ray_constants(&ray, Ro, Rd);
+	
+	inverse_Rd[0] = 1/Rd[0];
+	inverse_Rd[1] = 1/Rd[1];
+	inverse_Rd[2] = 1/Rd[2];
+	if(bvh->node_count > 0) stack[stack_size++] = 0;
+	while(stack_size > 0){	//Walk the tree, skipping any node the ray misses or only reaches past our best hit
+		node = &bvh->nodes[stack[--stack_size]];
+		if(!ray_box(Ro, inverse_Rd, node->min, node->max, best_t)) continue;
+		if(node->count == 0){	//Push the far child first, so the near child is visited first
+			if(Rd[node->axis] < 0){
+				stack[stack_size++] = node->start;
+				stack[stack_size++] = node->start + 1;
+			}else{
+				stack[stack_size++] = node->start + 1;
+				stack[stack_size++] = node->start;
+			}
+			continue;
+		}
+		thread_stats.sphere_tests += node->count;
+		sphere_kernel(&ray, bvh, node->start, node->count, t_min, exclude, &best_t, &best_index);	//Test every sphere in this leaf
+	}
+	intersection->best_index = best_index;
+	intersection->best_t = best_t;
+}
+
+//Find the closest hit of every ray in the packet, sharing one walk of the tree between them
+//Each ray gets exactly the hit closest_hit() would give it, since a node is only skipped once every ray misses it
+void closest_hit_packet(Scene* scene, Ray_packet* packet){
+	Bvh* bvh = &scene->bvh;
+	Sphere_array* spheres = &scene->spheres;
+	Plane_array* planes = &scene->planes;
+	Bvh_node* node;
+	double C[3];
+	double N[3];
+	Ray_constants ray[PACKET_SIZE];
+	double inverse_Rd[PACKET_SIZE][3];
+	double best_t[PACKET_SIZE];
+	int best_index[PACKET_SIZE];
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int mask;
+	int i, r;
+	
+	for(r = 0; r < packet->count; r++){
+		best_t[r] = INFINITY;
+		best_index[r] = -1;
+		ray_constants(&ray[r], packet->Ro[r], packet->Rd[r]);
+		inverse_Rd[r][0] = 1/packet->Rd[r][0];
+		inverse_Rd[r][1] = 1/packet->Rd[r][1];
+		inverse_Rd[r][2] = 1/packet->Rd[r][2];
+	}
+	
+	for(i = 0; i < planes->count; i++){	//Planes are unbounded, so test every one of them against every ray
+		if(spheres->count + i == packet->exclude) continue;
+		C[0] = planes->x[i];
+		C[1] = planes->y[i];
+		C[2] = planes->z[i];
+		N[0] = planes->nx[i];
+		N[1] = planes->ny[i];
+		N[2] = planes->nz[i];
+		thread_stats.plane_tests += packet->count;
+		for(r = 0; r < packet->count; r++){
+			keep_nearest(plane_intersection(packet->Ro[r], packet->Rd[r], C, N), spheres->count + i,
+							packet->t_min, packet->exclude, &best_t[r], &best_index[r]);
+		}
+	}
+	
+	if(bvh->node_count > 0) stack[stack_size++] = 0;
+	while(stack_size > 0){	//Walk the tree once for the whole packet, only the rays that enter a node test its spheres
+		node = &bvh->nodes[stack[--stack_size]];
+		mask = 0;
+		for(r = 0; r < packet->count; r++){	//Interior nodes only need one ray to enter them, leaves need to know every ray that does
+			if(ray_box(packet->Ro[r], inverse_Rd[r], node->min, node->max, best_t[r])){
+				mask |= 1 << r;
+				if(node->count == 0) break;
+			}
+		}
+		if(mask == 0) continue;
+		if(node->count == 0){	//Push the far child first, judged by the first ray, since packet rays point the same way
+			if(packet->Rd[0][node->axis] < 0){
+				stack[stack_size++] = node->start;
+				stack[stack_size++] = node->start + 1;
+			}else{
+				stack[stack_size++] = node->start + 1;
+				stack[stack_size++] = node->start;
+			}
+			continue;
+		}
+		for(r = 0; r < packet->count; r++){
+			if(mask & (1 << r)){
+				thread_stats.sphere_tests += node->count;
+				sphere_kernel(&ray[r], bvh, node->start, node->count, packet->t_min, packet->exclude, &best_t[r], &best_index[r]);
+			}
+		}
+	}
+	for(r = 0; r < packet->count; r++){
+		packet->hit[r].best_index = best_index[r];
+		packet->hit[r].best_t = best_t[r];
+	}
+}
+
+//Return 1 if anything other than exclude crosses the ray past t_min and before t_max, used for shadow rays
+//Unlike closest_hit() this stops at the first blocker found, and never enters a node that starts past t_max
+int occluded(Scene* scene, double* Ro, double* Rd, double t_min, int exclude, double t_max){
+	Bvh* bvh = &scene->bvh;
+	Sphere_array* spheres = &scene->spheres;
+	Plane_array* planes = &scene->planes;
+	Bvh_node* node;
+	double C[3];
+	double N[3];
+	Ray_constants ray;
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	double inverse_Rd[3];
+	double best_t = t_max;	//The kernels only keep hits nearer than best_t, so any hit they keep is a blocker
+	int best_index = -1;
+	int index;
+	int i;
+	
+	for(i = 0; i < planes->count; i++){
+		index = spheres->count + i;
+		if(index == exclude) continue;
+		thread_stats.plane_tests++;
+		C[0] = planes->x[i];
+		C[1] = planes->y[i];
+		C[2] = planes->z[i];
+		N[0] = planes->nx[i];
+		N[1] = planes->ny[i];
+		N[2] = planes->nz[i];
+		keep_nearest(plane_intersection(Ro, Rd, C, N), index, t_min, exclude, &best_t, &best_index);
+		if(best_index != -1) return 1;
+	}
+	
+	ray_constants(&ray, Ro, Rd);
+	
+	inverse_Rd[0] = 1/Rd[0];
+	inverse_Rd[1] = 1/Rd[1];
+	inverse_Rd[2] = 1/Rd[2];
+	if(bvh->node_count > 0) stack[stack_size++] = 0;
+	while(stack_size > 0){
+		node = &bvh->nodes[stack[--stack_size]];
+		if(!ray_box(Ro, inverse_Rd, node->min, node->max, t_max)) continue;
+		if(node->count == 0){	//Visiting the near child first finds blockers near the surface sooner
+			if(Rd[node->axis] < 0){
+				stack[stack_size++] = node->start;
+				stack[stack_size++] = node->start + 1;
+			}else{
+				stack[stack_size++] = node->start + 1;
+				stack[stack_size++] = node->start;
+			}
+			continue;
+		}
+		thread_stats.sphere_tests += node->count;
+		sphere_kernel(&ray, bvh, node->start, node->count, t_min, exclude, &best_t, &best_index);
+		if(best_index != -1) return 1;
+	}
+	return 0;
+}
+
+//Packet version of occluded(), each ray stops taking part as soon as a blocker is found for it
+//hit[r].best_index is set to a blocker of ray r, or -1 if nothing blocks it before t_max[r]
+void occluded_packet(Scene* scene, Ray_packet* packet){
+	Bvh* bvh = &scene->bvh;
+	Sphere_array* spheres = &scene->spheres;
+	Plane_array* planes = &scene->planes;
+	Bvh_node* node;
+	double C[3];
+	double N[3];
+	Ray_constants ray[PACKET_SIZE];
+	double inverse_Rd[PACKET_SIZE][3];
+	double best_t[PACKET_SIZE];
+	int best_index[PACKET_SIZE];
+	int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	int active = 0;	//Bit r is set while ray r has not found a blocker
+	int mask;
+	int i, r;
+	
+	for(r = 0; r < packet->count; r++){
+		best_t[r] = packet->t_max[r];
+		best_index[r] = -1;
+		active |= 1 << r;
+	}
+	
+	for(i = 0; i < planes->count; i++){
+		if(spheres->count + i == packet->exclude) continue;
+		C[0] = planes->x[i];
+		C[1] = planes->y[i];
+		C[2] = planes->z[i];
+		N[0] = planes->nx[i];
+		N[1] = planes->ny[i];
+		N[2] = planes->nz[i];
+		for(r = 0; r < packet->count; r++){
+			if(!(active & (1 << r))) continue;
+			thread_stats.plane_tests++;
+			keep_nearest(plane_intersection(packet->Ro[r], packet->Rd[r], C, N), spheres->count + i,
+							packet->t_min, packet->exclude, &best_t[r], &best_index[r]);
+			if(best_index[r] != -1) active &= ~(1 << r);
+		}
+	}
+	
+	for(r = 0; r < packet->count; r++){
+		ray_constants(&ray[r], packet->Ro[r], packet->Rd[r]);
+		inverse_Rd[r][0] = 1/packet->Rd[r][0];
+		inverse_Rd[r][1] = 1/packet->Rd[r][1];
+		inverse_Rd[r][2] = 1/packet->Rd[r][2];
+	}
+	if(bvh->node_count > 0) stack[stack_size++] = 0;
+	while(stack_size > 0 && active != 0){
+		node = &bvh->nodes[stack[--stack_size]];
+		mask = 0;
+		for(r = 0; r < packet->count; r++){
+			if((active & (1 << r)) && ray_box(packet->Ro[r], inverse_Rd[r], node->min, node->max, packet->t_max[r])){
+				mask |= 1 << r;
+				if(node->count == 0) break;
+			}
+		}
+		if(mask == 0) continue;
+		if(node->count == 0){
+			if(packet->Rd[0][node->axis] < 0){
+				stack[stack_size++] = node->start;
+				stack[stack_size++] = node->start + 1;
+			}else{
+				stack[stack_size++] = node->start + 1;
+				stack[stack_size++] = node->start;
+			}
+			continue;
+		}
+		for(r = 0; r < packet->count; r++){
+			if(mask & (1 << r)){
+				thread_stats.sphere_tests += node->count;
+				sphere_kernel(&ray[r], bvh, node->start, node->count, packet->t_min, packet->exclude, &best_t[r], &best_index[r]);
+				if(best_index[r] != -1) active &= ~(1 << r);
+			}
+		}
+	}
+	for(r = 0; r < packet->count; r++){
+		packet->hit[r].best_index = best_index[r];
+		packet->hit[r].best_t = best_t[r];
+	}
+}
+
+Tuple shoot(Scene* scene, double* Ro, double* Rd){	//Find object intersections
+	Tuple intersection;
+	closest_hit(scene, Ro, Rd, .0001, -1, &intersection);
+	return intersection;
+}
+
+void add_reflection_ray(Scene* scene, Ray_node* node){	//Queue the reflection of the ray that reached node, unless it would add too little
+	Secondary_ray* ray = &node->children[node->child_count];
+	Vector R1;
+	double weight = node->weight*scene->materials.reflectivity[node->best_index];
+	if(weight <= options.min_weight){	//Shading is clamped to 1, so this reflection can add at most weight
+		return;
+	}
+	R1 = reflect(node->Rd, node->N);	//Reflect ray coming from camera to find reflection
+	normalize(R1.v);
+	memcpy(ray->Ro, node->Ron, sizeof(double)*3);
+	memcpy(ray->Rd, R1.v, sizeof(double)*3);
+	ray->kind = 0;
+	ray->weight = weight;
+	node->child_count++;
+}
+
+void add_refraction_ray(Scene* scene, Ray_node* node){	//Queue the refraction of the ray that reached node, unless it would add too little
+	Secondary_ray* ray = &node->children[node->child_count];
+	int best_index = node->best_index;
+	double* Ron = node->Ron;
+	double N1[3];
+	double C[3];
+	Vector refracted_vector;
+	Vector refracted_vector1;
+	double t = 0;
+	double weight = node->weight*scene->materials.refractivity[best_index];
+	if(weight <= options.min_weight){	//Shading is clamped to 1, so this refraction can add at most weight
+		return;
+	}
+	if(best_index < scene->spheres.count){//If the object is a sphere, two refractions must be performed
+		C[0] = scene->spheres.x[best_index];
+		C[1] = scene->spheres.y[best_index];
+		C[2] = scene->spheres.z[best_index];
+		refracted_vector1 = refract(node->Rd, node->N, scene->materials.ior[best_index]);	//Calculate first refraction
+		//Find next sphere intersection with refracted vector
+		thread_stats.sphere_tests++;
+		t = special_sphere_intersection(Ron, refracted_vector1.v, C, scene->spheres.radius2[best_index]);
+		if(t <= .0001 || t == INFINITY){	//If no intersection found, just use our current vector and point as the final refracted ray
+			refracted_vector = refracted_vector1;
+			ray->Ro[0] = Ron[0];
+			ray->Ro[1] = Ron[1];
+			ray->Ro[2] = Ron[2];
+		}else{	//If interesection is found, calculate a new refracted vector with our previous refracted vector
+			ray->Ro[0] = Ron[0] + refracted_vector1.v[0]*t;
+			ray->Ro[1] = Ron[1] + refracted_vector1.v[1]*t;
+			ray->Ro[2] = Ron[2] + refracted_vector1.v[2]*t;
+			N1[0] = C[0] - ray->Ro[0];
+			N1[1] = C[1] - ray->Ro[1];
+			N1[2] = C[2] - ray->Ro[2];
+			normalize(N1);
+			refracted_vector = refract(refracted_vector1.v, N1, scene->materials.ior[best_index]);
+		}
+	}
+	else{	//If object is a plane, we need to calculate for refraction only once
+		refracted_vector = refract(node->Rd, node->N, scene->materials.ior[best_index]);
+		memcpy(ray->Ro, Ron, sizeof(double)*3);
+	}
+	memcpy(ray->Rd, refracted_vector.v, sizeof(double)*3);
+	ray->kind = 1;
+	ray->weight = weight;
+	node->child_count++;
+}
+
+//Start shading the surface a ray hit: find its normal, then build its reflection and refraction rays
+void enter_ray_node(Scene* scene, Ray_node* node, double* Ro, double* Rd, double best_t, int best_index, int layer, double weight){
+	node->Ron[0] = best_t * Rd[0] + Ro[0];	//Calculate the intersection point of the object we hit
+	node->Ron[1] = best_t * Rd[1] + Ro[1];
+	node->Ron[2] = best_t * Rd[2] + Ro[2];
+	memcpy(node->Rd, Rd, sizeof(double)*3);
+	node->best_index = best_index;
+	node->layer = layer;
+	node->weight = weight;
+	memset(node->secondary, 0, sizeof(node->secondary));	//Children that miss, or are never traced, add black
+	node->child_count = 0;
+	node->next_child = 0;
+	if(layer > thread_stats.max_depth) thread_stats.max_depth = layer;
+	
+	//Calculate object normals
+	if(best_index < scene->spheres.count){
+		node->N[0] = node->Ron[0] - scene->spheres.x[best_index];
+		node->N[1] = node->Ron[1] - scene->spheres.y[best_index];
+		node->N[2] = node->Ron[2] - scene->spheres.z[best_index];
+		normalize(node->N);
+	}
+	else{	//Plane normals were normalized once when the scene was finalized
+		memcpy(node->N, scene->planes.normal[best_index - scene->spheres.count], sizeof(double)*3);
+	}
+	
+	if(layer >= options.max_depth) return;	//Children past the deepest layer would be black
+	add_reflection_ray(scene, node);
+	add_refraction_ray(scene, node);
+}
+
+void trace_secondary_ray(Scene* scene, Secondary_ray* ray){	//Find what a reflection or refraction ray hits
+	if(ray->kind == 0) thread_stats.reflection_rays++;
+	else thread_stats.refraction_rays++;
+	ray->hit = shoot(scene, ray->Ro, ray->Rd);
+}
+
+int secondary_hit(Secondary_ray* ray){	//Return 1 if a traced reflection or refraction ray hit something
+	return ray->hit.best_t > 0 && ray->hit.best_t != INFINITY;
+}
+
+//Point lights at the lights listed by the grid cell around P, and return how many there are
+static inline int nearby_lights(Light_grid* grid, double* P, int** lights){
+	double x;
+	int cell[3];
+	int i;
+	for(i = 0; i < 3; i++){
+		x = (P[i] - grid->min[i])*grid->scale[i];
+		if(!(x >= 0 && x < grid->size[i])) return 0;	//Outside the grid only the unbounded lights reach
+		cell[i] = (int)x;
+	}
+	i = (cell[2]*grid->size[1] + cell[1])*grid->size[0] + cell[0];
+	*lights = grid->cells + grid->starts[i];
+	return grid->starts[i + 1] - grid->starts[i];
+}
+
+//Return 0 if --light-cutoff rules out light adding to a point distance away from it, where L points from the point to the light
+//Lights outside their radius add no more than the cutoff, and points outside a spotlight's cone get nothing from it
+static inline int light_reaches(Scene* scene, int light, double* L, double distance){
+	double* direction = scene->lights.direction[light];
+	if(scene->light_grid.radius == NULL) return 1;
+	if(distance > scene->light_grid.radius[light]) return 0;
+	//This is fang()'s cos_phi, which uses the vector from the light to the point
+	if(scene->lights.spotlight[light] && -L[0]*direction[0] - L[1]*direction[1] - L[2]*direction[2] < scene->lights.cos_theta[light]) return 0;
+	return 1;
+}
+
+int packet_reaches(Scene* scene, int light, Ray_packet* shadow){	//Return 1 if light may add to the point any ray of the shadow packet starts at
+	int r;
+	for(r = 0; r < shadow->count; r++){
+		if(light_reaches(scene, light, shadow->Rd[r], shadow->t_max[r])) return 1;
+	}
+	return 0;
+}
+
+//Finish shading a surface once its children are done, adding the light it receives to its reflected and refracted color
+//shadowed holds a flag per light if the shadow rays were already traced (or NULL)
+Vector shade_lights(Scene* scene, Ray_node* node, char* shadowed){
+	int best_index = node->best_index;
+	int in_shadow = 0;
+	int parse_count = 0;
+	Light_array* lights = &scene->lights;
+	double Rdn[3];
+	Vector result;
+	double* color = result.v;
+	Vector diffused_color;
+	Vector speculared_color;
+	double L[3];
+	Vector R;
+	double V[3];
+	double distance_from_light;
+	double portion_not_refracted_reflected = scene->materials.local_weight[best_index];
+	double radial_attenuation;
+	double angular_attenuation;
+	Light_grid* grid = &scene->light_grid;
+	int unbounded_count = lights->count;	//Without a light grid every light is visited, in order
+	int nearby_count = 0;
+	int* nearby = NULL;
+	int visit;
+	
+	color[0] = 0;
+	color[1] = 0;
+	color[2] = 0;
+	color[0] += node->secondary[0].v[0] + node->secondary[1].v[0];
+	color[1] += node->secondary[0].v[1] + node->secondary[1].v[1];
+	color[2] += node->secondary[0].v[2] + node->secondary[1].v[2];
+	
+	if(grid->radius != NULL){	//Only lights that reach every point, and those listed by the cell around this one, can light it
+		unbounded_count = grid->unbounded_count;
+		nearby_count = nearby_lights(grid, node->Ron, &nearby);
+	}
+	for(visit = 0; visit < unbounded_count + nearby_count; visit++){	//Iterate through our lights
+		if(visit >= unbounded_count) parse_count = nearby[visit - unbounded_count];
+		else parse_count = grid->radius != NULL ? grid->unbounded[visit] : visit;
+		//Create vector pointing to light source, originating from our intersection
+		Rdn[0] = lights->position[parse_count][0] - node->Ron[0];
+		Rdn[1] = lights->position[parse_count][1] - node->Ron[1];
+		Rdn[2] = lights->position[parse_count][2] - node->Ron[2];
+		distance_from_light = calculate_distance(Rdn);	//Calculate distance from light to intersection
+		normalize(Rdn);	//normalize our object to light vector
+		if(!light_reaches(scene, parse_count, Rdn, distance_from_light)) continue;
+		
+		//Check to see if our point of intersection is in shadow, the object we intersected cannot overshadow itself!
+		//Objects found behind the light do not cast a shadow
+		if(shadowed != NULL){	//A packet already traced this shadow ray
+			in_shadow = shadowed[parse_count];
+		}else{
+			thread_stats.shadow_rays++;
+			in_shadow = occluded(scene, node->Ron, Rdn, 0, best_index, distance_from_light);
+		}
+		
+		L[0] = Rdn[0];	//Store object to light vector into L
+		L[1] = Rdn[1];
+		L[2] = Rdn[2];
+		
+		V[0] = node->Rd[0];	//Store vector pointing from camera to object
+		V[1] = node->Rd[1];
+		V[2] = node->Rd[2];
+		
+		if(!in_shadow){	//node->N was normalized once by enter_ray_node()
+			R = reflect(L, node->N);	//Get reflected vector of L
+			
+			//Calculate diffuse and specular color
+			diffused_color = diffuse(L, node->N, scene->materials.diffuse_color[best_index], lights->color[parse_count]);
+			speculared_color = specular(R.v, V, scene->materials.specular_color[best_index], lights->color[parse_count], node->N, L,
+									scene->materials.ns[best_index], scene->materials.whole_ns[best_index]);
+			
+			//Reverse direction of Rdn to be used in angular attenuation calculations
+			Rdn[0] = -Rdn[0];
+			Rdn[1] = -Rdn[1];
+			Rdn[2] = -Rdn[2];
+			//Add total light values together
+			radial_attenuation = frad(lights->radial_a0[parse_count], lights->radial_a1[parse_count],
+								lights->radial_a2[parse_count], distance_from_light);
+			angular_attenuation = 1;	//Lights that are not spotlights shine the same in every direction
+			if(lights->spotlight[parse_count]){
+				angular_attenuation = fang(lights->angular_a0[parse_count], lights->whole_a0[parse_count], lights->cos_theta[parse_count], Rdn,
+									lights->direction[parse_count]);
+			}
+							
+			color[0] += 	portion_not_refracted_reflected *
+							radial_attenuation *
+							angular_attenuation *
+							(diffused_color.v[0] + speculared_color.v[0]);
+							
+			color[1] += 	portion_not_refracted_reflected *
+							radial_attenuation *
+							angular_attenuation *
+							(diffused_color.v[1] + speculared_color.v[1]);
+							
+			color[2] += 	portion_not_refracted_reflected *
+							radial_attenuation *
+							angular_attenuation *
+							(diffused_color.v[2] + speculared_color.v[2]);
+		}
+	}
+	//Clamp color values
+	color[0] = clamp(color[0]);
+	color[1] = clamp(color[1]);
+	color[2] = clamp(color[2]);
+	return result;
+}
+
+//Shade a ray that hit best_index, walking its tree of reflections and refractions depth first on stack instead of recursing
+//stack must have room for options.max_depth nodes, shadowed is passed on to shade_lights() for the first surface
+Vector shade_ray(Scene* scene, Ray_node* stack, double* Ro, double* Rd, double best_t, int best_index, char* shadowed){
+	Vector color = {{0, 0, 0}};
+	Ray_node* node;
+	Secondary_ray* ray;
+	double factor;
+	int depth;
+	int i;
+	
+	if(options.max_depth < 1) return color;
+	enter_ray_node(scene, &stack[0], Ro, Rd, best_t, best_index, 1, 1);
+	depth = 1;
+	while(1){
+		node = &stack[depth - 1];
+		if(node->next_child == 0){	//Trace both children back to back, before either of them is shaded
+			for(i = 0; i < node->child_count; i++) trace_secondary_ray(scene, &node->children[i]);
+		}
+		while(node->next_child < node->child_count && !secondary_hit(&node->children[node->next_child])){
+			node->next_child++;	//Skip children that did not hit anything
+		}
+		if(node->next_child < node->child_count){	//Descend into the next child
+			ray = &node->children[node->next_child++];
+			enter_ray_node(scene, &stack[depth], ray->Ro, ray->Rd, ray->hit.best_t, ray->hit.best_index, node->layer + 1, ray->weight);
+			depth++;
+			continue;
+		}
+		
+		color = shade_lights(scene, node, depth == 1 ? shadowed : NULL);	//Every child is done, so this surface is too
+		if(--depth == 0) return color;
+		node = &stack[depth - 1];	//Hand the color to the parent, scaled by how much of it reflects or refracts
+		ray = &node->children[node->next_child - 1];
+		factor = ray->kind == 0 ? scene->materials.reflectivity[node->best_index] : scene->materials.refractivity[node->best_index];
+		node->secondary[ray->kind].v[0] = color.v[0]*factor;
+		node->secondary[ray->kind].v[1] = color.v[1]*factor;
+		node->secondary[ray->kind].v[2] = color.v[2]*factor;
+	}
+}
+
+//Create the normalized direction of the ray through point x, y of the image, measured in pixels so pixel centers are at .5
+void primary_ray(Render_job* job, double x, double y, double* Rd){
+	double cx = 0;
+	double cy = 0;
+	Rd[0] = cx - (job->w/2) + job->pixwidth * x;	//Create direction vector
+	Rd[1] = cy - (job->h/2) + job->pixheight * y;
+	Rd[2] = 1;
+	normalize(Rd);
+}
+
+//Allocate a zeroed (black) framebuffer using the layout from options, holding region of a width x height image (the whole image if it is NULL)
+//Returns 1 if it was allocated and 0 if there was not enough memory
+int allocate_framebuffer(Framebuffer* framebuffer, int width, int height, Region* region){
+	size_t pixels;
+	Region whole = {0, 0, width, height};
+	
+	if(region == NULL) region = &whole;
+	framebuffer->region = *region;
+	framebuffer->image_width = width;
+	framebuffer->image_height = height;
+	width = region->x1 - region->x0;
+	height = region->y1 - region->y0;
+	pixels = (size_t)width*height;
+	framebuffer->width = width;
+	framebuffer->height = height;
+	framebuffer->is_float = strcmp(options.framebuffer, "float") == 0;
+	framebuffer->planar = options.planar;
+	//calloc hands back untouched zero pages, so large images don't pay for clearing memory up front
+	framebuffer->data = calloc(pixels*3, framebuffer->is_float ? sizeof(float) : sizeof(double));
+	return framebuffer->data != NULL;
+}
+
+void create_framebuffer(Framebuffer* framebuffer, int width, int height, Region* region){	//Allocate a framebuffer, exiting if there is not enough memory
+	if(!allocate_framebuffer(framebuffer, width, height, region)){
+		fprintf(stderr, "Error: Could not allocate a %dx%d framebuffer\n", framebuffer->width, framebuffer->height);
+		exit(1);
+	}
+}
+
+void clear_framebuffer(Framebuffer* framebuffer){	//Set every pixel of the framebuffer back to black
+	memset(framebuffer->data, 0, (size_t)framebuffer->width*framebuffer->height*3*(framebuffer->is_float ? sizeof(float) : sizeof(double)));
+}
+
+size_t channel_index(Framebuffer* framebuffer, size_t pixel, int channel){	//Position of one channel of a pixel in the framebuffer
+	if(framebuffer->planar) return channel*(size_t)framebuffer->width*framebuffer->height + pixel;
+	return pixel*3 + channel;
+}
+
+void framebuffer_store(Framebuffer* framebuffer, size_t pixel, double* color){	//Store a color into a pixel of the framebuffer
+	int i;
+	for(i = 0; i < 3; i++){
+		if(framebuffer->is_float) ((float*)framebuffer->data)[channel_index(framebuffer, pixel, i)] = (float)color[i];
+		else ((double*)framebuffer->data)[channel_index(framebuffer, pixel, i)] = color[i];
+	}
+}
+
+double framebuffer_load(Framebuffer* framebuffer, size_t pixel, int channel){	//Read one channel of a pixel from the framebuffer
+	if(framebuffer->is_float) return ((float*)framebuffer->data)[channel_index(framebuffer, pixel, channel)];
+	return ((double*)framebuffer->data)[channel_index(framebuffer, pixel, channel)];
+}
+
+size_t pixel_index(Render_job* job, int x, int y){	//Position of pixel x, y in our framebuffer, flipped so row 0 is the top of the image
+	Framebuffer* framebuffer = job->framebuffer;
+	return (size_t)(job->M - 1 - y - framebuffer->region.y0)*framebuffer->width + (x - framebuffer->region.x0);
+}
+
+void store_pixel(Render_job* job, int x, int y, double* color){	//Store a color into our framebuffer
+	framebuffer_store(job->framebuffer, pixel_index(job, x, y), color);
+}
+
+//Raycast through point x, y of the image and return its color, hit gets the object the ray hit or -1 if it hit nothing
+Vector sample_pixel(Render_job* job, Worker* worker, double x, double y, int* hit){
+	double Ro[3];
+	double Rd[3];
+	Vector color = {{0, 0, 0}};
+	Tuple intersection;
+	
+	memcpy(Ro, job->scene->camera_position, sizeof(double)*3);	//Create origin point for our vector
+	
+	primary_ray(job, x, y, Rd);
+	thread_stats.primary_rays++;
+	intersection = shoot(job->scene, Ro, Rd);
+	
+	*hit = -1;
+	if(intersection.best_t > 0 && intersection.best_t != INFINITY){	//If our closest intersection is valid...
+		*hit = intersection.best_index;
+		color = shade_ray(job->scene, worker->ray_stack, Ro, Rd, intersection.best_t, intersection.best_index, NULL);
+	}
+	return color;
+}
+
+void render_pixel(Render_job* job, Worker* worker, int x, int y){	//Raycast a single pixel and store its color into the framebuffer
+	Vector color;
+	int hit;
+	
+	color = sample_pixel(job, worker, x + .5, y + .5, &hit);
+	if(hit != -1) store_pixel(job, x, y, color.v);	//Pixels that hit nothing stay black
+}
+
+void render_samples(Render_job* job, Worker* worker, int x, int y){	//Raycast pixel x, y with the rays asked for by the job's pass
+	int samples = job->pass.samples;
+	double color[3] = {0, 0, 0};
+	Vector sample;
+	int first = -1;
+	int hit;
+	int i, j;
+	
+	for(j = 0; j < samples; j++){	//Spread the rays over an even grid, a single ray goes through the center like render_pixel()
+		for(i = 0; i < samples; i++){
+			sample = sample_pixel(job, worker, x + (i + .5)/samples, y + (j + .5)/samples, &hit);
+			color[0] += sample.v[0];
+			color[1] += sample.v[1];
+			color[2] += sample.v[2];
+			if(i == 0 && j == 0) first = hit;
+			else if(hit != first) first = -2;
+		}
+	}
+	color[0] /= samples*samples;
+	color[1] /= samples*samples;
+	color[2] /= samples*samples;
+	store_pixel(job, x, y, color);
+	if(job->pass.hits != NULL) job->pass.hits[pixel_index(job, x, y)] = first;
+}
+
+void render_packet(Render_job* job, Worker* worker, int x0, int y0){	//Raycast the 2x2 block of pixels at x0, y0 as one packet
+	Scene* scene = job->scene;
+	Light_array* lights = &scene->lights;
+	Ray_packet primary;
+	Ray_packet shadow;
+	double Ron[PACKET_SIZE][3];
+	Vector color;
+	int pixel_x[PACKET_SIZE];
+	int pixel_y[PACKET_SIZE];
+	int coherent;
+	int i, l, r;
+	
+	primary.count = 0;
+	primary.t_min = .0001;
+	primary.exclude = -1;
+	for(i = 0; i < PACKET_SIZE; i++){	//Pixels past the edge of the image are left out of the packet
+		if(x0 + i%2 >= job->x1 || y0 + i/2 >= job->y1) continue;
+		r = primary.count++;
+		pixel_x[r] = x0 + i%2;
+		pixel_y[r] = y0 + i/2;
+		memcpy(primary.Ro[r], scene->camera_position, sizeof(double)*3);
+		primary_ray(job, pixel_x[r] + .5, pixel_y[r] + .5, primary.Rd[r]);
+	}
+	thread_stats.primary_rays += primary.count;
+	closest_hit_packet(scene, &primary);
+	
+	//Shadow rays stay coherent only while every ray hit the same primitive, otherwise each ray is shaded on its own
+	coherent = primary.hit[0].best_index != -1;
+	for(r = 1; r < primary.count; r++){
+		if(primary.hit[r].best_index != primary.hit[0].best_index) coherent = 0;
+	}
+	if(coherent){
+		for(r = 0; r < primary.count; r++){	//Calculate the intersection points, the same way enter_ray_node() does
+			Ron[r][0] = primary.hit[r].best_t * primary.Rd[r][0] + primary.Ro[r][0];
+			Ron[r][1] = primary.hit[r].best_t * primary.Rd[r][1] + primary.Ro[r][1];
+			Ron[r][2] = primary.hit[r].best_t * primary.Rd[r][2] + primary.Ro[r][2];
+		}
+		shadow.count = primary.count;
+		shadow.t_min = 0;
+		shadow.exclude = primary.hit[0].best_index;	//The object we intersected cannot overshadow itself!
+		for(l = 0; l < lights->count; l++){	//Trace one shadow packet toward each light
+			for(r = 0; r < primary.count; r++){
+				memcpy(shadow.Ro[r], Ron[r], sizeof(double)*3);
+				shadow.Rd[r][0] = lights->position[l][0] - Ron[r][0];
+				shadow.Rd[r][1] = lights->position[l][1] - Ron[r][1];
+				shadow.Rd[r][2] = lights->position[l][2] - Ron[r][2];
+				shadow.t_max[r] = calculate_distance(shadow.Rd[r]);	//Objects behind the light do not cast a shadow
+				normalize(shadow.Rd[r]);
+			}
+			if(!packet_reaches(scene, l, &shadow)) continue;	//shade_lights() skips this light for every ray
+			thread_stats.shadow_rays += shadow.count;
+			occluded_packet(scene, &shadow);
+			for(r = 0; r < primary.count; r++){
+				worker->shadowed[r*lights->count + l] = shadow.hit[r].best_index != -1;
+			}
+		}
+	}
+	
+	for(r = 0; r < primary.count; r++){
+		if(primary.hit[r].best_t > 0 && primary.hit[r].best_t != INFINITY){	//If our closest intersection is valid...
+			color = shade_ray(scene, worker->ray_stack, primary.Ro[r], primary.Rd[r], primary.hit[r].best_t, primary.hit[r].best_index,
+								coherent ? &worker->shadowed[r*lights->count] : NULL);
+			store_pixel(job, pixel_x[r], pixel_y[r], color.v);
+		}
+	}
+}
+
+void grow_wave(Scene* scene, Wave* wave, int capacity){	//Make room for capacity nodes in the wave
+	wave->capacity = capacity;
+	wave->nodes = realloc(wave->nodes, sizeof(Wave_node)*capacity);
+	wave->shadowed = realloc(wave->shadowed, (size_t)capacity*scene->lights.count + 1);
+	if(wave->nodes == NULL || wave->shadowed == NULL){
+		fprintf(stderr, "Error: Out of memory while rendering\n");
+		exit(1);
+	}
+}
+
+Wave_node* add_wave_node(Scene* scene, Wave* wave){	//Append a node to the wave, growing it as needed
+	//Waves start with room for two surfaces per pixel of a tile, so they rarely grow once rendering has started
+	if(wave->count == wave->capacity) grow_wave(scene, wave, 2*wave->capacity);
+	return &wave->nodes[wave->count++];
+}
+
+void trace_wave_shadows(Scene* scene, Wave* wave){	//Trace the shadow rays of every node in the wave, in packets of nodes that hit the same object
+	Light_array* lights = &scene->lights;
+	Ray_packet shadow;
+	Ray_node* node;
+	int start, l, r;
+	
+	shadow.t_min = 0;
+	for(start = 0; start < wave->count; start += shadow.count){
+		shadow.exclude = wave->nodes[start].node.best_index;	//The object we intersected cannot overshadow itself!
+		shadow.count = 1;
+		while(shadow.count < PACKET_SIZE && start + shadow.count < wave->count &&
+				wave->nodes[start + shadow.count].node.best_index == shadow.exclude){
+			shadow.count++;
+		}
+		for(l = 0; l < lights->count; l++){	//Trace one shadow packet toward each light, the same way render_packet() does
+			for(r = 0; r < shadow.count; r++){
+				node = &wave->nodes[start + r].node;
+				memcpy(shadow.Ro[r], node->Ron, sizeof(double)*3);
+				shadow.Rd[r][0] = lights->position[l][0] - node->Ron[0];
+				shadow.Rd[r][1] = lights->position[l][1] - node->Ron[1];
+				shadow.Rd[r][2] = lights->position[l][2] - node->Ron[2];
+				shadow.t_max[r] = calculate_distance(shadow.Rd[r]);	//Objects behind the light do not cast a shadow
+				normalize(shadow.Rd[r]);
+			}
+			if(!packet_reaches(scene, l, &shadow)) continue;
+			thread_stats.shadow_rays += shadow.count;
+			occluded_packet(scene, &shadow);
+			for(r = 0; r < shadow.count; r++){
+				wave->shadowed[(size_t)(start + r)*lights->count + l] = shadow.hit[r].best_index != -1;
+			}
+		}
+	}
+}
+
+//Trace a packet of reflection or refraction rays leaving wave, queueing the surfaces they hit in next
+//parent and child say which node of wave, and which of its children, each ray in the packet belongs to
+void trace_wave_packet(Scene* scene, Wave* wave, Wave* next, Ray_packet* packet, int* parent, int* child){
+	Ray_node* node;
+	Secondary_ray* ray;
+	Wave_node* hit;
+	int r;
+	
+	closest_hit_packet(scene, packet);
+	for(r = 0; r < packet->count; r++){
+		node = &wave->nodes[parent[r]].node;
+		ray = &node->children[child[r]];
+		if(ray->kind == 0) thread_stats.reflection_rays++;
+		else thread_stats.refraction_rays++;
+		if(packet->hit[r].best_t > 0 && packet->hit[r].best_t != INFINITY){	//Children that miss add black
+			hit = add_wave_node(scene, next);
+			hit->parent = parent[r];
+			hit->kind = ray->kind;
+			enter_ray_node(scene, &hit->node, ray->Ro, ray->Rd, packet->hit[r].best_t, packet->hit[r].best_index, node->layer + 1, ray->weight);
+		}
+	}
+	packet->count = 0;
+}
+
+void trace_wave_children(Scene* scene, Wave* wave, Wave* next){	//Trace every reflection, then every refraction, leaving the wave
+	Ray_packet packet;
+	Secondary_ray* ray;
+	int parent[PACKET_SIZE];
+	int child[PACKET_SIZE];
+	int kind, i, j;
+	
+	next->count = 0;
+	packet.count = 0;
+	packet.t_min = .0001;
+	packet.exclude = -1;
+	for(kind = 0; kind < 2; kind++){	//Keeping reflections and refractions apart keeps the packets coherent
+		for(i = 0; i < wave->count; i++){
+			for(j = 0; j < wave->nodes[i].node.child_count; j++){
+				ray = &wave->nodes[i].node.children[j];
+				if(ray->kind != kind) continue;
+				memcpy(packet.Ro[packet.count], ray->Ro, sizeof(double)*3);
+				memcpy(packet.Rd[packet.count], ray->Rd, sizeof(double)*3);
+				parent[packet.count] = i;
+				child[packet.count] = j;
+				if(++packet.count == PACKET_SIZE) trace_wave_packet(scene, wave, next, &packet, parent, child);
+			}
+		}
+		if(packet.count > 0) trace_wave_packet(scene, wave, next, &packet, parent, child);
+	}
+}
+
+//Raycast every pixel with x0 <= x < x1 and y0 <= y < y1 breadth first: all primary rays are traced, then all of their
+//shadow rays, then all of their reflections and refractions, and so on down to options.max_depth, before anything is shaded
+//Surfaces are then shaded deepest layer first, so every surface's children are done before the surface itself
+void render_wavefront(Render_job* job, Worker* worker, int x0, int y0, int x1, int y1){
+	Scene* scene = job->scene;
+	Ray_packet primary;
+	Wave* wave;
+	Wave_node* node;
+	Ray_node* parent;
+	Vector color;
+	double factor;
+	int pixel[PACKET_SIZE];
+	int layers;
+	int x, y, i, r;
+	
+	if(options.max_depth < 1) return;	//Nothing is shaded, so every pixel stays black
+	wave = &worker->waves[0];
+	wave->count = 0;
+	primary.count = 0;
+	primary.t_min = .0001;
+	primary.exclude = -1;
+	for(y = y0; y < y1; y++){	//Trace the primary rays in packets of pixels next to each other on a row
+		for(x = x0; x < x1; x++){
+			pixel[primary.count] = (y - y0)*(x1 - x0) + (x - x0);
+			memcpy(primary.Ro[primary.count], scene->camera_position, sizeof(double)*3);
+			primary_ray(job, x + .5, y + .5, primary.Rd[primary.count]);
+			if(++primary.count < PACKET_SIZE && (x + 1 < x1 || y + 1 < y1)) continue;
+			
+			thread_stats.primary_rays += primary.count;
+			closest_hit_packet(scene, &primary);
+			for(r = 0; r < primary.count; r++){
+				if(primary.hit[r].best_t > 0 && primary.hit[r].best_t != INFINITY){	//If our closest intersection is valid...
+					node = add_wave_node(scene, wave);
+					node->parent = pixel[r];
+					node->kind = 0;
+					enter_ray_node(scene, &node->node, primary.Ro[r], primary.Rd[r], primary.hit[r].best_t, primary.hit[r].best_index, 1, 1);
+				}
+			}
+			primary.count = 0;
+		}
+	}
+	
+	layers = 0;
+	while(layers < options.max_depth && worker->waves[layers].count > 0){	//Trace each wave's shadows and children in turn
+		trace_wave_shadows(scene, &worker->waves[layers]);
+		if(layers + 1 < options.max_depth) trace_wave_children(scene, &worker->waves[layers], &worker->waves[layers + 1]);
+		layers++;
+	}
+	
+	while(layers-- > 0){	//Shade the deepest wave first, handing each color to its parent or its pixel
+		wave = &worker->waves[layers];
+		for(i = 0; i < wave->count; i++){
+			node = &wave->nodes[i];
+			color = shade_lights(scene, &node->node, &wave->shadowed[(size_t)i*scene->lights.count]);
+			if(layers == 0){
+				store_pixel(job, x0 + node->parent % (x1 - x0), y0 + node->parent / (x1 - x0), color.v);
+				continue;
+			}
+			parent = &worker->waves[layers - 1].nodes[node->parent].node;	//Scale by how much of the parent reflects or refracts
+			factor = node->kind == 0 ? scene->materials.reflectivity[parent->best_index] : scene->materials.refractivity[parent->best_index];
+			parent->secondary[node->kind].v[0] = color.v[0]*factor;
+			parent->secondary[node->kind].v[1] = color.v[1]*factor;
+			parent->secondary[node->kind].v[2] = color.v[2]*factor;
+		}
+	}
+}
+
+void render_block(Render_job* job, Worker* worker, int x, int y, int size){	//Raycast pixel x, y and fill the size x size block it starts
+	double color[3] = {0, 0, 0};
+	size_t pixel = pixel_index(job, x, y);
+	int i, j;
+	
+	store_pixel(job, x, y, color);	//Rays that miss leave the pixel alone, so clear anything a coarser pass filled in
+	render_pixel(job, worker, x, y);
+	if(size == 1) return;
+	for(i = 0; i < 3; i++) color[i] = framebuffer_load(job->framebuffer, pixel, i);
+	for(j = y; j < y + size && j < job->y1; j++){	//Blocks never cross a tile, so no other thread writes to them
+		for(i = x; i < x + size && i < job->x1; i++){
+			store_pixel(job, i, j, color);
+		}
+	}
+}
+
+void render_region(Render_job* job, Worker* worker, int x0, int y0, int x1, int y1){	//Raycast every pixel with x0 <= x < x1 and y0 <= y < y1
+	int step = job->pass.step;
+	int skip = job->pass.skip;
+	int x, y;
+	if(job->pass.samples > 1 || job->pass.hits != NULL || job->pass.refine != NULL){	//Anti-aliasing pass, one pixel at a time
+		for(y = y0; y < y1; y++){
+			for(x = x0; x < x1; x++){
+				if(job->pass.refine == NULL || job->pass.refine[pixel_index(job, x, y)]) render_samples(job, worker, x, y);
+			}
+		}
+		return;
+	}
+	if(step > 1 || skip > 0){	//Progressive pass, raycast one pixel per block, one at a time
+		for(y = (y0 + step - 1)/step*step; y < y1; y += step){
+			for(x = (x0 + step - 1)/step*step; x < x1; x += step){
+				if(skip == 0 || x % skip != 0 || y % skip != 0) render_block(job, worker, x, y, step);
+			}
+		}
+		return;
+	}
+	if(options.wavefront){	//Waves are kept to a tile at a time, so their queues stay small enough for the cache
+		for(y = y0; y < y1; y += TILE_SIZE){
+			for(x = x0; x < x1; x += TILE_SIZE){
+				render_wavefront(job, worker, x, y, x + TILE_SIZE < x1 ? x + TILE_SIZE : x1, y + TILE_SIZE < y1 ? y + TILE_SIZE : y1);
+			}
+		}
+		return;
+	}
+	if(options.packets){
+		for(y = y0; y < y1; y += 2){
+			for(x = x0; x < x1; x += 2){
+				render_packet(job, worker, x, y);
+			}
+		}
+		return;
+	}
+	for(y = y0; y < y1; y += 1){
+		for(x = x0; x < x1; x += 1){
+			render_pixel(job, worker, x, y);
+		}
+	}
+}
+
+int next_tile(Render_job* job, int id){	//Pop a tile off our own queue, or steal one from another worker, returns -1 when none are left
+	Tile_queue* queue = &job->queues[id];
+	int tile = -1;
+	int i;
+	
+	pthread_mutex_lock(&queue->lock);
+	if(queue->head < queue->tail) tile = queue->head++;
+	pthread_mutex_unlock(&queue->lock);
+	
+	for(i = 1; tile == -1 && i < job->num_workers; i++){	//Our queue is empty, so steal from the tail of the others
+		queue = &job->queues[(id + i) % job->num_workers];
+		pthread_mutex_lock(&queue->lock);
+		if(queue->head < queue->tail) tile = --queue->tail;
+		pthread_mutex_unlock(&queue->lock);
+	}
+	return tile;
+}
+
+void* render_worker(void* input){	//Thread entry point, renders tiles until every queue is empty
+	Worker* worker = input;
+	Render_job* job = worker->job;
+	int tile;
+	int x0, y0, x1, y1;
+	
+	memset(&thread_stats, 0, sizeof(Stats));
+	while((tile = next_tile(job, worker->id)) != -1){	//Clip each tile to the pixels being raycast
+		x0 = job->tile_x0 + (tile % job->tiles_x) * TILE_SIZE;
+		y0 = job->tile_y0 + (tile / job->tiles_x) * TILE_SIZE;
+		x1 = x0 + TILE_SIZE < job->x1 ? x0 + TILE_SIZE : job->x1;
+		y1 = y0 + TILE_SIZE < job->y1 ? y0 + TILE_SIZE : job->y1;
+		render_region(job, worker, x0 > job->x0 ? x0 : job->x0, y0 > job->y0 ? y0 : job->y0, x1, y1);
+	}
+	worker->stats = thread_stats;
+	return NULL;
+}
+
+void add_stats(Stats* total, Stats* input){	//Add the counters of input to total
+	total->primary_rays += input->primary_rays;
+	total->shadow_rays += input->shadow_rays;
+	total->reflection_rays += input->reflection_rays;
+	total->refraction_rays += input->refraction_rays;
+	total->sphere_tests += input->sphere_tests;
+	total->plane_tests += input->plane_tests;
+	if(input->max_depth > total->max_depth) total->max_depth = input->max_depth;
+}
+
+long total_rays(Stats* stats){	//Return every ray counted in stats
+	return stats->primary_rays + stats->shadow_rays + stats->reflection_rays + stats->refraction_rays;
+}
+
+void free_worker(Worker* worker){	//Release a worker's scratch buffers
+	int i;
+	for(i = 0; i <= options.max_depth; i++){
+		free(worker->waves[i].nodes);
+		free(worker->waves[i].shadowed);
+	}
+	free(worker->waves);
+	free(worker->shadowed);
+	free(worker->ray_stack);
+}
+
+//This raycasts the pixels of our scene picked by pass (every pixel if it is NULL) inside the framebuffer's region of the N x M image
+//The work done by every thread is added to stats, and returns how many rays were traced
+long raycast_scene(Scene* scene, Framebuffer* framebuffer, int N, int M, Render_pass* pass, Stats* stats){
+	Render_job job;
+	Stats job_stats = {0};
+	Worker* workers;
+	pthread_t* threads;
+	int num_tiles;
+	int i, j;
+#ifdef COUNT_ALLOCATIONS
+	long allocations;
+#endif
+	
+	//Grab camera width and height, and calculate our pixel widths and pixel heights
+	job.scene = scene;
+	job.framebuffer = framebuffer;
+	if(pass != NULL){
+		job.pass = *pass;
+	}else{
+		job.pass.step = 1;
+		job.pass.skip = 0;
+		job.pass.samples = 1;
+		job.pass.hits = NULL;
+		job.pass.refine = NULL;
+	}
+	job.N = N;
+	job.M = M;
+	job.x0 = framebuffer->region.x0;	//Flip the region, so it counts rows from the bottom like primary_ray()
+	job.x1 = framebuffer->region.x1;
+	job.y0 = M - framebuffer->region.y1;
+	job.y1 = M - framebuffer->region.y0;
+	job.w = scene->camera_width;
+	job.pixwidth = job.w/N;
+	job.h = scene->camera_height;
+	job.pixheight = job.h/M;
+	
+	job.num_workers = options.threads;
+	if(job.num_workers == 0) job.num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(job.num_workers < 1) job.num_workers = 1;
+	
+	workers = malloc(sizeof(Worker)*job.num_workers);
+	for(i = 0; i < job.num_workers; i++){	//Give every worker its own scratch buffers
+		workers[i].job = &job;
+		workers[i].id = i;
+		workers[i].shadowed = malloc(PACKET_SIZE*scene->lights.count + 1);
+		workers[i].ray_stack = malloc(sizeof(Ray_node)*(options.max_depth + 1));
+		workers[i].waves = calloc(options.max_depth + 1, sizeof(Wave));
+		for(j = 0; options.wavefront && j < options.max_depth; j++) grow_wave(scene, &workers[i].waves[j], 2*TILE_SIZE*TILE_SIZE);
+	}
+	
+	if(job.num_workers == 1){	//Serial path, raycast every shape for each pixel on this thread
+#ifdef COUNT_ALLOCATIONS
+		allocations = allocation_count;
+#endif
+		memset(&thread_stats, 0, sizeof(Stats));
+		render_region(&job, &workers[0], job.x0, job.y0, job.x1, job.y1);
+		add_stats(stats, &thread_stats);
+#ifdef COUNT_ALLOCATIONS
+		report_allocations(allocations);
+#endif
+		free_worker(&workers[0]);
+		free(workers);
+		return total_rays(&thread_stats);
+	}
+	
+	//Split the region into tiles, and give each worker an even, contiguous share of them to start with
+	job.tile_x0 = job.x0/TILE_SIZE*TILE_SIZE;
+	job.tile_y0 = job.y0/TILE_SIZE*TILE_SIZE;
+	job.tiles_x = (job.x1 - job.tile_x0 + TILE_SIZE - 1)/TILE_SIZE;
+	job.tiles_y = (job.y1 - job.tile_y0 + TILE_SIZE - 1)/TILE_SIZE;
+	num_tiles = job.tiles_x*job.tiles_y;
+	job.queues = malloc(sizeof(Tile_queue)*job.num_workers);
+	threads = malloc(sizeof(pthread_t)*job.num_workers);
+	for(i = 0; i < job.num_workers; i++){
+		job.queues[i].head = (int)((long)num_tiles*i/job.num_workers);
+		job.queues[i].tail = (int)((long)num_tiles*(i + 1)/job.num_workers);
+		pthread_mutex_init(&job.queues[i].lock, NULL);
+	}
+	
+#ifdef COUNT_ALLOCATIONS
+	allocations = allocation_count;
+#endif
+	for(i = 1; i < job.num_workers; i++){	//This thread acts as worker 0
+		if(pthread_create(&threads[i], NULL, render_worker, &workers[i]) != 0){
+			fprintf(stderr, "Error: Could not create render thread\n");
+			exit(1);
+		}
+	}
+	render_worker(&workers[0]);
+	for(i = 1; i < job.num_workers; i++){
+		pthread_join(threads[i], NULL);
+	}
+#ifdef COUNT_ALLOCATIONS
+	report_allocations(allocations);
+#endif
+	
+	for(i = 0; i < job.num_workers; i++){
+		pthread_mutex_destroy(&job.queues[i].lock);
+		free_worker(&workers[i]);
+		add_stats(&job_stats, &workers[i].stats);
+	}
+	add_stats(stats, &job_stats);
+	free(threads);
+	free(workers);
+	free(job.queues);
+	return total_rays(&job_stats);
+}
+
+void write_image(Framebuffer* framebuffer, FILE* output_pointer){	//Quantize the framebuffer and stream it out as a P6 image one row at a time
+	int width = framebuffer->width;
+	char* row;
+	size_t pixel = 0;
+	int x;
+	int y;
+	
+	row = malloc(width*3);
+	fprintf(output_pointer, "P6\n");	//Write P6 header to output.ppm
+	if(width != framebuffer->image_width || framebuffer->height != framebuffer->image_height){	//Say where a region goes, for --merge
+		fprintf(output_pointer, "# raytrace region %d %d %d %d of %d %d\n", framebuffer->region.x0, framebuffer->region.y0,
+				framebuffer->region.x1, framebuffer->region.y1, framebuffer->image_width, framebuffer->image_height);
+	}
+	fprintf(output_pointer, "%d %d\n255\n", width, framebuffer->height);
+	for(y = 0; y < framebuffer->height; y++){	//Quantize one row into a character buffer, then write it out
+		for(x = 0; x < width; x++){
+			row[x*3] = (int)(255*framebuffer_load(framebuffer, pixel, 0));
+			row[x*3 + 1] = (int)(255*framebuffer_load(framebuffer, pixel, 1));
+			row[x*3 + 2] = (int)(255*framebuffer_load(framebuffer, pixel, 2));
+			pixel++;
+		}
+		fwrite(row, sizeof(char), width*3, output_pointer);	//Write row to output.ppm
+	}
+	free(row);
+}
+
+void create_image(Framebuffer* framebuffer, char* output){	//Write the framebuffer into a .ppm file
+	FILE *output_pointer = fopen(output, "wb");	/*Open the output file*/
+	if(output_pointer == NULL){
+		fprintf(stderr, "Error: Could not open file \"%s\"\n", output);
+		exit(1);
+	}
+	write_image(framebuffer, output_pointer);
+	fclose(output_pointer);
+}
+
+//Read the header of a P6 image with 255 as its maximum value, returns 1 if it is one
+//region and the image size say where its pixels go, taken from the comment written by write_image() or the whole image if there is none
+int read_ppm_header(FILE* input, Region* region, int* image_width, int* image_height){
+	char comment[256];
+	int values[3];
+	int count = 0;
+	int c;
+	
+	if(fgetc(input) != 'P' || fgetc(input) != '6') return 0;
+	region->x1 = 0;
+	while(count < 3){	//Read the width, height and maximum value, along with any comments between them
+		c = fgetc(input);
+		if(c == '#'){
+			if(fgets(comment, sizeof(comment), input) == NULL) return 0;
+			sscanf(comment, " raytrace region %d %d %d %d of %d %d", &region->x0, &region->y0, &region->x1, &region->y1, image_width, image_height);
+		}else if(isdigit(c)){
+			ungetc(c, input);
+			if(fscanf(input, "%d", &values[count++]) != 1) return 0;
+		}else if(!isspace(c)){
+			return 0;
+		}
+	}
+	if(values[2] != 255 || !isspace(fgetc(input))) return 0;	//One whitespace character comes before the pixels
+	if(region->x1 == 0){
+		region->x0 = 0;
+		region->y0 = 0;
+		region->x1 = *image_width = values[0];
+		region->y1 = *image_height = values[1];
+	}
+	return values[0] > 0 && values[1] > 0 && values[0] == region->x1 - region->x0 && values[1] == region->y1 - region->y0 &&
+			region->x0 >= 0 && region->y0 >= 0 && region->x1 <= *image_width && region->y1 <= *image_height;
+}
+
+//Stitch images rendered with --region into output, which must be covered exactly once by the parts
+//Each row of a part is written straight to its place in output, so the whole image is never held in memory
+void merge_images(char* output, char** parts, int part_count){
+	FILE* output_pointer;
+	FILE* input;
+	Region* regions = malloc(sizeof(Region)*part_count);
+	char* row = NULL;
+	long header_size;
+	long covered = 0;
+	int image_width = 0;
+	int image_height = 0;
+	int width;
+	int height;
+	int i, j, y;
+	
+	for(i = 0; i < part_count; i++){	//Check that the parts fit together before writing anything
+		input = fopen(parts[i], "rb");
+		if(input == NULL || !read_ppm_header(input, &regions[i], &width, &height)){
+			fprintf(stderr, "Error: \"%s\" is not a P6 image\n", parts[i]);
+			exit(1);
+		}
+		fclose(input);
+		if(i > 0 && (width != image_width || height != image_height)){
+			fprintf(stderr, "Error: \"%s\" is part of a %dx%d image, not a %dx%d one\n", parts[i], width, height, image_width, image_height);
+			exit(1);
+		}
+		image_width = width;
+		image_height = height;
+		for(j = 0; j < i; j++){
+			if(regions[i].x0 < regions[j].x1 && regions[j].x0 < regions[i].x1 && regions[i].y0 < regions[j].y1 && regions[j].y0 < regions[i].y1){
+				fprintf(stderr, "Error: \"%s\" and \"%s\" overlap\n", parts[j], parts[i]);
+				exit(1);
+			}
+		}
+		covered += (long)(regions[i].x1 - regions[i].x0)*(regions[i].y1 - regions[i].y0);
+	}
+	if(covered != (long)image_width*image_height){
+		fprintf(stderr, "Error: The parts do not cover the whole %dx%d image\n", image_width, image_height);
+		exit(1);
+	}
 	
-	if(layer > MAX_RECURSION){	//Exit function if we have recursed too far
-		return color;
-	}
-	
-	//Calculate object normals, as well as portions of color dedicated to reflection and refraction
-	if(object_array[best_index]->kind == 1){
-		N[0] = Ron[0] - object_array[best_index]->sphere.position[0];
-		N[1] = Ron[1] - object_array[best_index]->sphere.position[1];
-		N[2] = Ron[2] - object_array[best_index]->sphere.position[2];
-		portion_not_refracted_reflected = 1 - object_array[best_index]->sphere.reflectivity -
-											object_array[best_index]->sphere.refractivity;
-	}
-	else if(object_array[best_index]->kind == 2){
-		N[0] = object_array[best_index]->plane.normal[0];
-		N[1] = object_array[best_index]->plane.normal[1];
-		N[2] = object_array[best_index]->plane.normal[2];
-		portion_not_refracted_reflected = 1 - object_array[best_index]->plane.reflectivity -
-											object_array[best_index]->plane.refractivity;
-	}
-	normalize(N);
-	
-	//Calculate reflection and refraction color values, add them to color total
-	reflected_color = get_reflect_color(object_array, object_counter, best_index, Ron, Rd, N, layer);
-	refracted_color = get_refract_color(object_array, object_counter, best_index, Ron, Rd, N, layer);
-	color[0] += reflected_color[0] + refracted_color[0];
-	color[1] += reflected_color[1] + refracted_color[1];
-	color[2] += reflected_color[2] + refracted_color[2];
-	
-	free(reflected_color);
-	free(refracted_color);
-	
-	while(parse_count < object_counter + 1){	//Iterate through object array and check for lights
-		if(object_array[parse_count]->kind == 3){
-			//Create vector pointing to light source, originating from our intersection
-			Rdn[0] = object_array[parse_count]->light.position[0] - Ron[0];
-			Rdn[1] = object_array[parse_count]->light.position[1] - Ron[1];
-			Rdn[2] = object_array[parse_count]->light.position[2] - Ron[2];
-			distance_from_light = calculate_distance(Rdn);	//Calculate distance from light to intersection
-			normalize(Rdn);	//normalize our object to light vector
-			
-			while(parse_count1 < object_counter + 1){	//Check to see if our point of intersection is in shadow
-				if(parse_count1 == best_index){	//The object we intersected cannot overshadow itself!
-					parse_count1++;
-					continue;
-				}
-				if(object_array[parse_count1]->kind == 1){	//See if a sphere overshadows our point of intersection
-					t = sphere_intersection(Ron, Rdn, object_array[parse_count1]->sphere.position,
-									object_array[parse_count1]->sphere.radius);			
-					parse_count1++;
-				}else if(object_array[parse_count1]->kind == 2){ //See if a plane overshadows our point of intersection
-					t = plane_intersection(Ron, Rdn, object_array[parse_count1]->plane.position,
-											object_array[parse_count1]->plane.normal);
-					parse_count1++;
-				}else{	//If a light was found, skip it
-					parse_count1++;
-					continue;
-				}
-				
-				if(t > 0 && t < distance_from_light){	//If a valid overshadowing object was found, break
-					break;
-				}else if(t > 0 && t > distance_from_light){ //If object found behind light, it does not cast a shadow
-					t = 0;
-				}
+	output_pointer = fopen(output, "wb");
+	if(output_pointer == NULL){
+		fprintf(stderr, "Error: Could not open file \"%s\"\n", output);
+		exit(1);
+	}
+	fprintf(output_pointer, "P6\n%d %d\n255\n", image_width, image_height);
+	header_size = ftell(output_pointer);
+	for(i = 0; i < part_count; i++){
+		input = fopen(parts[i], "rb");
+		read_ppm_header(input, &regions[i], &width, &height);
+		width = regions[i].x1 - regions[i].x0;
+		row = realloc(row, (size_t)width*3);
+		for(y = regions[i].y0; y < regions[i].y1; y++){
+			if(fread(row, 3, width, input) != (size_t)width){
+				fprintf(stderr, "Error: \"%s\" is truncated\n", parts[i]);
+				exit(1);
 			}
-			
-			L[0] = Rdn[0];	//Store object to light vector into L
-			L[1] = Rdn[1];
-			L[2] = Rdn[2];
-			
-			V[0] = Rd[0];	//Store vector pointing from camera to object
-			V[1] = Rd[1];
-			V[2] = Rd[2];
-			
-			if(t <= 0){
-				if(object_array[best_index]->kind == 1){
-					normalize(N);
-					R = reflect(L, N);	//Get reflected vector of L
-					
-					//Calculate diffuse and specular color
-					diffused_color = diffuse(L, N, object_array[best_index]->sphere.diffuse_color,
-												object_array[parse_count]->light.color);
-					speculared_color = specular(R, V, object_array[best_index]->sphere.specular_color,
-												object_array[parse_count]->light.color, N, L);
-					
-				}else if(object_array[best_index]->kind == 2){
-					
-					
-					R = reflect(L, N);  //Get reflected vector of L
-					
-					//Calculate diffuse and specular color
-					diffused_color = diffuse(L, N, object_array[best_index]->plane.diffuse_color,
-												object_array[parse_count]->light.color);
-					speculared_color = specular(R, V, object_array[best_index]->plane.specular_color,
-												object_array[parse_count]->light.color, N, L);
-					
-				}
-				else{	//If the current object is somehow a light
-					fprintf(stderr,"Error: Tried to render light as a shape primitive");
-					exit(1);
-				}
-				
-				
-				//Reverse direction of Rdn to be used in angular attenuation calculations
-				Rdn[0] = -Rdn[0];
-				Rdn[1] = -Rdn[1];
-				Rdn[2] = -Rdn[2];
-				//Add total light values together
-				radial_attenuation = frad(object_array[parse_count]->light.radial_a0,
-								object_array[parse_count]->light.radial_a1,
-								object_array[parse_count]->light.radial_a2, distance_from_light);
-				angular_attenuation = fang(object_array[parse_count]->light.angular_a0,
-								object_array[parse_count]->light.theta, Rdn,
-								object_array[parse_count]->light.direction);
-								
-				color[0] += 	portion_not_refracted_reflected *
-								radial_attenuation *
-								angular_attenuation *
-								(diffused_color[0] + speculared_color[0]);
-								
-				color[1] += 	portion_not_refracted_reflected *
-								radial_attenuation *
-								angular_attenuation *
-								(diffused_color[1] + speculared_color[1]);
-								
-				color[2] += 	portion_not_refracted_reflected *
-								radial_attenuation *
-								angular_attenuation *
-								(diffused_color[2] + speculared_color[2]);
-				
-				free(diffused_color);	//free memory
-				free(speculared_color);
-				free(R);
-			}
-			t = 0;
-			parse_count1 = 1;
-		}
-		parse_count++;
+			fseek(output_pointer, header_size + ((long)y*image_width + regions[i].x0)*3, SEEK_SET);
+			fwrite(row, 3, width, output_pointer);
+		}
+		fclose(input);
 	}
-	//Clamp color values
-	color[0] = clamp(color[0]);
-	color[1] = clamp(color[1]);
-	color[2] = clamp(color[2]);
-	return color;
+	free(row);
+	free(regions);
+	fclose(output_pointer);
 }
 
-void raycast_scene(Object** object_array, int object_counter, double** pixel_buffer, int N, int M){	//This raycasts our object_array
-	int parse_count = 0;
-	int pixel_count = 0;
+//Compare two P6 images of the same size channel by channel, print how far apart they are, and return 1 if any channel
+//differs by more than tolerance, otherwise 0
+int diff_images(char* expected, char* actual, int tolerance){
+	char* paths[2] = {expected, actual};
+	FILE* inputs[2];
+	Region region;
+	int widths[2];
+	int heights[2];
+	long differing = 0;
+	long total = 0;
+	int largest = 0;
+	int difference;
+	int a, b;
 	int i;
-	double Ro[3];
-	double Rd[3];
-	double* color;
-	double cx = 0;
-	double cy = 0;
-	double w;
-	double h;
-	double pixwidth;
-	double pixheight;
-	Tuple* intersection;
 	
-	if(object_array[parse_count]->kind != 0){	//If camera is not present, throw an error
-		fprintf(stderr, "Error: You must have one object of type camera\n");
+	for(i = 0; i < 2; i++){
+		inputs[i] = fopen(paths[i], "rb");
+		if(inputs[i] == NULL || !read_ppm_header(inputs[i], &region, &widths[i], &heights[i])){
+			fprintf(stderr, "Error: \"%s\" is not a P6 image\n", paths[i]);
+			exit(1);
+		}
+		widths[i] = region.x1 - region.x0;	//Only the pixels in the file are compared
+		heights[i] = region.y1 - region.y0;
+	}
+	if(widths[0] != widths[1] || heights[0] != heights[1]){
+		fprintf(stderr, "Error: \"%s\" is %dx%d, but \"%s\" is %dx%d\n", expected, widths[0], heights[0], actual, widths[1], heights[1]);
 		exit(1);
 	}
+	for(i = 0; i < widths[0]*heights[0]*3; i++){
+		a = fgetc(inputs[0]);
+		b = fgetc(inputs[1]);
+		if(a == EOF || b == EOF){
+			fprintf(stderr, "Error: \"%s\" is truncated\n", a == EOF ? expected : actual);
+			exit(1);
+		}
+		difference = abs(a - b);
+		total += difference;
+		if(difference > 0) differing++;
+		if(difference > largest) largest = difference;
+	}
+	fclose(inputs[0]);
+	fclose(inputs[1]);
+	printf("%s: %ld of %d channels differ, largest difference %d, mean difference %.6f\n", actual, differing,
+			widths[0]*heights[0]*3, largest, (double)total/(widths[0]*heights[0]*3));
+	return largest > tolerance;
+}
+
+int pixels_differ(Framebuffer* framebuffer, int* hits, size_t a, size_t b, double threshold){	//Return 1 if there is an edge between pixels a and b
+	int i;
+	if(hits[a] != hits[b]) return 1;
+	for(i = 0; i < 3; i++){
+		if(fabs(framebuffer_load(framebuffer, a, i) - framebuffer_load(framebuffer, b, i)) > threshold) return 1;
+	}
+	return 0;
+}
+
+//Flag every pixel of the framebuffer that hit a different object than one of its neighbors, or differs from it by more than threshold
+//hits holds the object each pixel hit, as filled in by a pass of raycast_scene()
+void find_edges(Framebuffer* framebuffer, int* hits, char* refine, double threshold){
+	size_t pixel;
+	int x, y;
+	
+	memset(refine, 0, (size_t)framebuffer->width*framebuffer->height);
+	for(y = 0; y < framebuffer->height; y++){
+		for(x = 0; x < framebuffer->width; x++){
+			pixel = (size_t)y*framebuffer->width + x;
+			if(hits[pixel] == -2) refine[pixel] = 1;	//The pixel's own rays already cross an edge
+			if(x + 1 < framebuffer->width && pixels_differ(framebuffer, hits, pixel, pixel + 1, threshold)){
+				refine[pixel] = 1;
+				refine[pixel + 1] = 1;
+			}
+			if(y + 1 < framebuffer->height && pixels_differ(framebuffer, hits, pixel, pixel + framebuffer->width, threshold)){
+				refine[pixel] = 1;
+				refine[pixel + framebuffer->width] = 1;
+			}
+		}
+	}
+}
+
+//Raycast the framebuffer with options.aa_min x options.aa_min rays per pixel, then again with options.aa_max x options.aa_max rays
+//on the pixels find_edges() flags, so only edges pay for the extra rays. Returns how many rays were traced, or -1 if the
+//anti-aliasing buffers could not be allocated
+long raycast_edges(Scene* scene, Framebuffer* framebuffer, int N, int M, Stats* stats){
+	Render_pass pass = {1, 0, options.aa_min, NULL, NULL};
+	size_t pixels = (size_t)framebuffer->width*framebuffer->height;
+	int* hits;
+	char* refine;
+	long rays;
 	
-	//Grab camera width and height, and calculate our pixel widths and pixel heights
-	w = object_array[parse_count]->camera.width;
-	pixwidth = w/N;
-	h = object_array[parse_count]->camera.height;
-	pixheight = h/M;
-	parse_count++;
-	
-	//Create origin point for our vector
-	Ro[0] = 0;
-	Ro[1] = 0;
-	Ro[2] = 0;
-	
-	for(int y = 0; y < M; y += 1){	//Raycast every shape for each pixel
-		for(int x = 0; x < N; x += 1){
-			Rd[0] = cx - (w/2) + pixwidth * (x + .5);	//Create direction vector
-			Rd[1] = cy - (h/2) + pixheight * (y + .5);
-			Rd[2] = 1;
-			normalize(Rd);
-			intersection = shoot(object_array, object_counter, Ro, Rd);
+	if(options.aa_max <= options.aa_min) return raycast_scene(scene, framebuffer, N, M, &pass, stats);	//Nothing to refine
+	hits = malloc(sizeof(int)*pixels);
+	refine = malloc(pixels);
+	if(hits == NULL || refine == NULL){	//Left to the caller, so one --serve request can fail without stopping the server
+		free(hits);
+		free(refine);
+		return -1;
+	}
+	pass.hits = hits;
+	rays = raycast_scene(scene, framebuffer, N, M, &pass, stats);
+	find_edges(framebuffer, hits, refine, options.aa_threshold);
+	pass.samples = options.aa_max;	//Then raycast the edges again, every other pixel keeps its first color
+	pass.hits = NULL;
+	pass.refine = refine;
+	rays += raycast_scene(scene, framebuffer, N, M, &pass, stats);
+	free(hits);
+	free(refine);
+	return rays;
+}
 
-			
-			if(intersection->best_t > 0 && intersection->best_t != INFINITY){	//If our closest intersection is valid...
-				//render light, and store the outputted colors into our pixel array
-				color = render_light(object_array, object_counter, intersection->best_t, intersection->best_index, Ro, Rd, 1);
-				pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][0] = color[0];
-				pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][1] = color[1];
-				pixel_buffer[(int)((N*M) - (floor(pixel_count/N) + 1)*N)+ pixel_count%N][2] = color[2];
-				
-				free(color);
-				parse_count = 1;
-			}else{
-				parse_count = 1;
+//Anti-alias the framebuffer's region of the image with raycast_edges()
+//Edges on the border of a region depend on the pixels around it, so a region is raycast along with a one pixel ring around it,
+//which keeps its pixels the same as in a render of the whole image. Returns -1 like raycast_edges() if memory runs out
+long raycast_antialiased(Scene* scene, Framebuffer* framebuffer, int N, int M, Stats* stats){
+	Region region = framebuffer->region;
+	Framebuffer padded;
+	double color[3];
+	long rays;
+	int x, y, i;
+	
+	if(region.x0 == 0 && region.y0 == 0 && region.x1 == N && region.y1 == M) return raycast_edges(scene, framebuffer, N, M, stats);
+	region.x0 -= region.x0 > 0;
+	region.y0 -= region.y0 > 0;
+	region.x1 += region.x1 < N;
+	region.y1 += region.y1 < M;
+	if(!allocate_framebuffer(&padded, N, M, &region)) return -1;
+	rays = raycast_edges(scene, &padded, N, M, stats);
+	if(rays < 0){
+		free(padded.data);
+		return -1;
+	}
+	for(y = 0; y < framebuffer->height; y++){	//Copy the region back out of the ring
+		for(x = 0; x < framebuffer->width; x++){
+			for(i = 0; i < 3; i++){
+				color[i] = framebuffer_load(&padded, (size_t)(y + framebuffer->region.y0 - region.y0)*padded.width + x + framebuffer->region.x0 - region.x0, i);
 			}
-			pixel_count++;
-			free(intersection);
+			framebuffer_store(framebuffer, (size_t)y*framebuffer->width + x, color);
 		}
 	}
+	free(padded.data);
+	return rays;
 }
 
-void create_image(double** pixel_buffer, char* output, int width, int height){	//Stores pixel array info into a .ppm file
-	FILE *output_pointer = fopen(output, "wb");	/*Open the output file*/
-	char buffer[width*height*3];
-	int counter = 0;
+//Raycast every pixel of the framebuffer, anti-aliased if --aa asked for it
+//Returns how many rays were traced, or -1 if there was not enough memory for anti-aliasing
+long raycast_frame(Scene* scene, Framebuffer* framebuffer, int N, int M, Stats* stats){
+	if(options.aa_min > 1 || options.aa_max > 1) return raycast_antialiased(scene, framebuffer, N, M, stats);
+	return raycast_scene(scene, framebuffer, N, M, NULL, stats);
+}
+
+//Render the image in passes, from one pixel in every PROGRESSIVE_STEP x PROGRESSIVE_STEP block down to every pixel, writing it out after each one
+//A named pipe gets one P6 image per pass on a single stream, anything else is replaced after every pass by renaming a finished copy over it
+//Every pixel is raycast by exactly one pass, so the last image is the same as a normal render
+long render_progressive(Scene* scene, Framebuffer* framebuffer, int N, int M, char* output, Stats* stats){
+	struct stat status;
+	Render_pass pass;
+	FILE* stream = NULL;
+	char* partial = NULL;
+	long rays = 0;
 	
-	while(counter < width*height){	//Iterate through pixel array, and store values into a character buffer
-		buffer[counter*3] = (int)(255*pixel_buffer[counter][0]);
-		buffer[counter*3 + 1] = (int)(255*pixel_buffer[counter][1]);
-		buffer[counter*3 + 2] = (int)(255*pixel_buffer[counter][2]);
-		counter++;
+	if(stat(output, &status) == 0 && S_ISFIFO(status.st_mode)){
+		stream = fopen(output, "wb");
+		if(stream == NULL){
+			fprintf(stderr, "Error: Could not open file \"%s\"\n", output);
+			exit(1);
+		}
+	}else{
+		partial = malloc(strlen(output) + 6);
+		sprintf(partial, "%s.part", output);
 	}
-	fprintf(output_pointer, "P6\n%d %d\n255\n", width, height);	//Write P6 header to output.ppm
-	fwrite(buffer, sizeof(char), width*height*3, output_pointer);	//Write buffer to output.ppm
 	
-	fclose(output_pointer);
+	pass.skip = 0;
+	pass.samples = 1;
+	pass.hits = NULL;
+	pass.refine = NULL;
+	for(pass.step = PROGRESSIVE_STEP; pass.step >= 1; pass.step /= 2){
+		rays += raycast_scene(scene, framebuffer, N, M, &pass, stats);
+		if(stream != NULL){
+			write_image(framebuffer, stream);
+			fflush(stream);
+		}else{
+			create_image(framebuffer, partial);
+			if(rename(partial, output) != 0){
+				fprintf(stderr, "Error: Could not replace file \"%s\"\n", output);
+				exit(1);
+			}
+		}
+		pass.skip = pass.step;
+	}
+	
+	if(stream != NULL) fclose(stream);
+	free(partial);
+	return rays;
 }
 
 void move_camera_to_front(Object** object_array, int object_count){	//Moves camera object to the front of object_array
@@ -1196,34 +3487,818 @@ void move_camera_to_front(Object** object_array, int object_count){	//Moves came
 	}
 }
 
+void free_arena(Arena* arena){	//Release every block held by the arena
+	int i;
+	for(i = 0; i < arena->block_count; i++){
+		free(arena->blocks[i]);
+	}
+	free(arena->blocks);
+	arena->blocks = NULL;
+	arena->block_count = 0;
+	arena->used = 0;
+	arena->size = 0;
+}
+
+void finalize_scene(Scene* scene){	//Precompute the values that only depend on the scene, so shading never recomputes them per ray
+	Sphere_array* spheres = &scene->spheres;
+	Plane_array* planes = &scene->planes;
+	Material_array* materials = &scene->materials;
+	Light_array* lights = &scene->lights;
+	int primitive_count = spheres->count + planes->count;
+	int i;
+	
+	spheres->radius2 = malloc(sizeof(double)*spheres->count);
+	planes->normal = malloc(sizeof(double)*3*planes->count);
+	materials->local_weight = malloc(sizeof(double)*primitive_count);
+	materials->whole_ns = malloc(sizeof(int)*primitive_count);
+	lights->cos_theta = malloc(sizeof(double)*lights->count);
+	lights->spotlight = malloc(sizeof(int)*lights->count);
+	lights->whole_a0 = malloc(sizeof(int)*lights->count);
+	
+	for(i = 0; i < spheres->count; i++){
+		spheres->radius2[i] = sqr(spheres->radius[i]);
+	}
+	for(i = 0; i < planes->count; i++){	//The raw normal stays as given, plane intersections use it unnormalized
+		planes->normal[i][0] = planes->nx[i];
+		planes->normal[i][1] = planes->ny[i];
+		planes->normal[i][2] = planes->nz[i];
+		normalize(planes->normal[i]);
+	}
+	for(i = 0; i < primitive_count; i++){
+		materials->local_weight[i] = 1 - materials->reflectivity[i] - materials->refractivity[i];
+		materials->whole_ns[i] = whole_exponent(materials->ns[i]);
+	}
+	for(i = 0; i < lights->count; i++){
+		lights->cos_theta[i] = cos(lights->theta[i]);
+		lights->spotlight[i] = lights->theta[i] != 0 && lights->angular_a0[i] != 0;
+		lights->whole_a0[i] = whole_exponent(lights->angular_a0[i]);
+	}
+}
+
+double light_radius(Light_array* lights, int i, double cutoff){	//Return the distance past which light i adds no more than cutoff to a channel
+	//Diffuse and specular each add at most the light's color and fang() is at most 1, so frad() bounds what the light adds
+	double brightest = 2*fmax(fabs(lights->color[i][0]), fmax(fabs(lights->color[i][1]), fabs(lights->color[i][2])));
+	double limit = brightest/cutoff;	//The light adds more than cutoff only while a0 + a1*d + a2*d^2 is below this
+	double a0 = lights->radial_a0[i];
+	double a1 = lights->radial_a1[i];
+	double a2 = lights->radial_a2[i];
+	
+	if(a0 < 0 || a1 < 0 || a2 < 0 || lights->angular_a0[i] < 0) return INFINITY;	//Negative terms can make a light brighter with distance
+	if(a0 >= limit) return 0;
+	if(a2 > 0) return (-a1 + sqrt(sqr(a1) - 4*a2*(a0 - limit)))/(2*a2);
+	if(a1 > 0) return (limit - a0)/a1;
+	return INFINITY;	//Lights without falloff reach everywhere
+}
+
+//Find how far every light reaches, and list the lights that reach each cell of a uniform grid around them, so shading
+//a point only visits the lights of its cell. Animations call this again every frame, so the old grid is released first
+void build_light_grid(Scene* scene, double cutoff){
+	Light_grid* grid = &scene->light_grid;
+	Light_array* lights = &scene->lights;
+	double max[3] = {-INFINITY, -INFINITY, -INFINITY};
+	double total_radius = 0;
+	double extent;
+	double low_edge;
+	double gap;
+	double distance2;
+	int low[3];
+	int high[3];
+	int cell[3];
+	int* next = NULL;
+	int bounded = 0;
+	int cell_count;
+	int pass, axis, i, c;
+	
+	free(grid->radius);
+	free(grid->unbounded);
+	free(grid->starts);
+	free(grid->cells);
+	grid->radius = malloc(sizeof(double)*(lights->count + 1));
+	grid->unbounded = malloc(sizeof(int)*(lights->count + 1));
+	grid->unbounded_count = 0;
+	grid->min[0] = grid->min[1] = grid->min[2] = INFINITY;
+	for(i = 0; i < lights->count; i++){	//Find the reach of every light, and the box around every light that fades out
+		grid->radius[i] = light_radius(lights, i, cutoff);
+		if(grid->radius[i] == INFINITY){
+			grid->unbounded[grid->unbounded_count++] = i;
+			continue;
+		}
+		bounded++;
+		total_radius += grid->radius[i];
+		for(axis = 0; axis < 3; axis++){
+			grid->min[axis] = fmin(grid->min[axis], lights->position[i][axis] - grid->radius[i]);
+			max[axis] = fmax(max[axis], lights->position[i][axis] + grid->radius[i]);
+		}
+	}
+	for(axis = 0; axis < 3; axis++){	//Cells are about as wide as the average light reaches
+		extent = max[axis] - grid->min[axis];
+		grid->size[axis] = 0;
+		grid->scale[axis] = 0;
+		if(bounded == 0) continue;
+		grid->size[axis] = total_radius > 0 ? (int)fmin(extent*bounded/total_radius, LIGHT_GRID_MAX - 1) + 1 : 1;
+		if(extent > 0) grid->scale[axis] = grid->size[axis]/extent;
+	}
+	cell_count = grid->size[0]*grid->size[1]*grid->size[2];
+	grid->starts = calloc(cell_count + 1, sizeof(int));
+	grid->cells = NULL;
+	
+	for(pass = 0; pass < 2; pass++){	//Count the lights of every cell, then fill them in
+		for(i = 0; i < lights->count && bounded > 0; i++){
+			if(grid->radius[i] == INFINITY) continue;
+			for(axis = 0; axis < 3; axis++){	//Range of cells the light's bounding box covers
+				low[axis] = (int)((lights->position[i][axis] - grid->radius[i] - grid->min[axis])*grid->scale[axis]);
+				high[axis] = (int)((lights->position[i][axis] + grid->radius[i] - grid->min[axis])*grid->scale[axis]);
+				if(low[axis] < 0) low[axis] = 0;
+				if(high[axis] > grid->size[axis] - 1) high[axis] = grid->size[axis] - 1;
+			}
+			for(cell[2] = low[2]; cell[2] <= high[2]; cell[2]++){
+				for(cell[1] = low[1]; cell[1] <= high[1]; cell[1]++){
+					for(cell[0] = low[0]; cell[0] <= high[0]; cell[0]++){
+						distance2 = 0;
+						for(axis = 0; axis < 3; axis++){	//Distance from the light to the cell's box, flat axes have one cell
+							if(grid->scale[axis] == 0) continue;
+							low_edge = grid->min[axis] + cell[axis]/grid->scale[axis];
+							gap = fmax(low_edge - lights->position[i][axis], lights->position[i][axis] - (low_edge + 1/grid->scale[axis]));
+							if(gap > 0) distance2 += sqr(gap);
+						}
+						if(distance2 > sqr(grid->radius[i])) continue;
+						c = (cell[2]*grid->size[1] + cell[1])*grid->size[0] + cell[0];
+						if(pass == 0) grid->starts[c + 1]++;
+						else grid->cells[next[c]++] = i;
+					}
+				}
+			}
+		}
+		if(pass == 0){
+			for(c = 0; c < cell_count; c++) grid->starts[c + 1] += grid->starts[c];
+			grid->cells = malloc(sizeof(int)*(grid->starts[cell_count] + 1));
+			next = malloc(sizeof(int)*(cell_count + 1));
+			memcpy(next, grid->starts, sizeof(int)*(cell_count + 1));
+		}
+	}
+	free(next);
+}
+
+void pack_scene(Scene* scene){	//Copy the parsed objects into per kind arrays, then release the parsed objects
+	Sphere_array* spheres = &scene->spheres;
+	Plane_array* planes = &scene->planes;
+	Material_array* materials = &scene->materials;
+	Light_array* lights = &scene->lights;
+	Object* object;
+	int primitive_count;
+	int counter;
+	int i;
+	
+	if(scene->object_counter < 0 || scene->object_array[0]->kind != 0){	//If camera is not present, throw an error
+		fprintf(stderr, "Error: You must have one object of type camera\n");
+		exit(1);
+	}
+	scene->camera_width = scene->object_array[0]->camera.width;
+	scene->camera_height = scene->object_array[0]->camera.height;
+	
+	spheres->count = planes->count = lights->count = 0;
+	for(counter = 1; counter < scene->object_counter + 1; counter++){	//Count each kind so every array is allocated once
+		if(scene->object_array[counter]->kind == 1) spheres->count++;
+		else if(scene->object_array[counter]->kind == 2) planes->count++;
+		else if(scene->object_array[counter]->kind == 3) lights->count++;
+	}
+	primitive_count = spheres->count + planes->count;
+	
+	spheres->x = malloc(sizeof(double)*spheres->count);
+	spheres->y = malloc(sizeof(double)*spheres->count);
+	spheres->z = malloc(sizeof(double)*spheres->count);
+	spheres->radius = malloc(sizeof(double)*spheres->count);
+	planes->x = malloc(sizeof(double)*planes->count);
+	planes->y = malloc(sizeof(double)*planes->count);
+	planes->z = malloc(sizeof(double)*planes->count);
+	planes->nx = malloc(sizeof(double)*planes->count);
+	planes->ny = malloc(sizeof(double)*planes->count);
+	planes->nz = malloc(sizeof(double)*planes->count);
+	materials->diffuse_color = malloc(sizeof(double)*3*primitive_count);
+	materials->specular_color = malloc(sizeof(double)*3*primitive_count);
+	materials->reflectivity = malloc(sizeof(double)*primitive_count);
+	materials->refractivity = malloc(sizeof(double)*primitive_count);
+	materials->ior = malloc(sizeof(double)*primitive_count);
+	materials->ns = malloc(sizeof(double)*primitive_count);
+	lights->position = malloc(sizeof(double)*3*lights->count);
+	lights->color = malloc(sizeof(double)*3*lights->count);
+	lights->direction = malloc(sizeof(double)*3*lights->count);
+	lights->radial_a0 = malloc(sizeof(double)*lights->count);
+	lights->radial_a1 = malloc(sizeof(double)*lights->count);
+	lights->radial_a2 = malloc(sizeof(double)*lights->count);
+	lights->angular_a0 = malloc(sizeof(double)*lights->count);
+	lights->theta = malloc(sizeof(double)*lights->count);
+	
+	spheres->count = planes->count = lights->count = 0;
+	for(counter = 1; counter < scene->object_counter + 1; counter++){	//Copy every object into the arrays for its kind
+		object = scene->object_array[counter];
+		if(object->kind == 1){
+			i = spheres->count++;
+			spheres->x[i] = object->sphere.position[0];
+			spheres->y[i] = object->sphere.position[1];
+			spheres->z[i] = object->sphere.position[2];
+			spheres->radius[i] = object->sphere.radius;
+			memcpy(materials->diffuse_color[i], object->sphere.diffuse_color, sizeof(double)*3);
+			memcpy(materials->specular_color[i], object->sphere.specular_color, sizeof(double)*3);
+			materials->reflectivity[i] = object->sphere.reflectivity;
+			materials->refractivity[i] = object->sphere.refractivity;
+			materials->ior[i] = object->sphere.ior;
+			materials->ns[i] = object->sphere.ns;
+		}else if(object->kind == 3){
+			i = lights->count++;
+			memcpy(lights->position[i], object->light.position, sizeof(double)*3);
+			memcpy(lights->color[i], object->light.color, sizeof(double)*3);
+			memcpy(lights->direction[i], object->light.direction, sizeof(double)*3);
+			lights->radial_a0[i] = object->light.radial_a0;
+			lights->radial_a1[i] = object->light.radial_a1;
+			lights->radial_a2[i] = object->light.radial_a2;
+			lights->angular_a0[i] = object->light.angular_a0;
+			lights->theta[i] = object->light.theta;
+		}
+	}
+	for(counter = 1; counter < scene->object_counter + 1; counter++){	//Planes are numbered after every sphere
+		object = scene->object_array[counter];
+		if(object->kind == 2){
+			i = planes->count++;
+			planes->x[i] = object->plane.position[0];
+			planes->y[i] = object->plane.position[1];
+			planes->z[i] = object->plane.position[2];
+			planes->nx[i] = object->plane.normal[0];
+			planes->ny[i] = object->plane.normal[1];
+			planes->nz[i] = object->plane.normal[2];
+			i += spheres->count;
+			memcpy(materials->diffuse_color[i], object->plane.diffuse_color, sizeof(double)*3);
+			memcpy(materials->specular_color[i], object->plane.specular_color, sizeof(double)*3);
+			materials->reflectivity[i] = object->plane.reflectivity;
+			materials->refractivity[i] = object->plane.refractivity;
+			materials->ior[i] = object->plane.ior;
+			materials->ns[i] = object->plane.ns;
+		}
+	}
+	
+	free_arena(&scene->arena);	//The parsed objects are no longer needed
+	free(scene->object_array);
+	scene->object_array = NULL;
+	scene->object_counter = -1;
+	scene->object_capacity = 0;
+	finalize_scene(scene);
+}
+
+int scene_sections(Scene* scene, Scene_section* sections){	//List every array of a packed scene, in the order they are stored in a .rscn file
+	size_t spheres = scene->spheres.count*sizeof(double);
+	size_t planes = scene->planes.count*sizeof(double);
+	size_t primitives = spheres + planes;
+	size_t lights = scene->lights.count*sizeof(double);
+	size_t constants = (scene->spheres.count + SIMD_PADDING)*sizeof(double);
+	Scene_section list[] = {
+		{(void**)&scene->spheres.x, spheres}, {(void**)&scene->spheres.y, spheres},
+		{(void**)&scene->spheres.z, spheres}, {(void**)&scene->spheres.radius, spheres},
+		{(void**)&scene->planes.x, planes}, {(void**)&scene->planes.y, planes}, {(void**)&scene->planes.z, planes},
+		{(void**)&scene->planes.nx, planes}, {(void**)&scene->planes.ny, planes}, {(void**)&scene->planes.nz, planes},
+		{(void**)&scene->materials.diffuse_color, 3*primitives}, {(void**)&scene->materials.specular_color, 3*primitives},
+		{(void**)&scene->materials.reflectivity, primitives}, {(void**)&scene->materials.refractivity, primitives},
+		{(void**)&scene->materials.ior, primitives}, {(void**)&scene->materials.ns, primitives},
+		{(void**)&scene->lights.position, 3*lights}, {(void**)&scene->lights.color, 3*lights},
+		{(void**)&scene->lights.direction, 3*lights}, {(void**)&scene->lights.radial_a0, lights},
+		{(void**)&scene->lights.radial_a1, lights}, {(void**)&scene->lights.radial_a2, lights},
+		{(void**)&scene->lights.angular_a0, lights}, {(void**)&scene->lights.theta, lights},
+		{(void**)&scene->spheres.radius2, spheres}, {(void**)&scene->planes.normal, 3*planes},
+		{(void**)&scene->materials.local_weight, primitives}, {(void**)&scene->lights.cos_theta, lights},
+		{(void**)&scene->lights.spotlight, scene->lights.count*sizeof(int)},
+		{(void**)&scene->materials.whole_ns, (scene->spheres.count + scene->planes.count)*sizeof(int)},
+		{(void**)&scene->lights.whole_a0, scene->lights.count*sizeof(int)},
+		{(void**)&scene->bvh.nodes, scene->bvh.node_count*sizeof(Bvh_node)},
+		{(void**)&scene->bvh.indices, scene->spheres.count*sizeof(int)},
+		{(void**)&scene->bvh.constants.x, constants}, {(void**)&scene->bvh.constants.y, constants},
+		{(void**)&scene->bvh.constants.z, constants}, {(void**)&scene->bvh.constants.x2, constants},
+		{(void**)&scene->bvh.constants.y2, constants}, {(void**)&scene->bvh.constants.z2, constants},
+		{(void**)&scene->bvh.constants.r2, constants}
+	};
+	memcpy(sections, list, sizeof(list));
+	return sizeof(list)/sizeof(list[0]);
+}
+
+size_t align_section(size_t offset){	//Round offset up to the start of the next section
+	return (offset + RSCN_ALIGNMENT - 1)/RSCN_ALIGNMENT*RSCN_ALIGNMENT;
+}
+
+void write_compiled_scene(Scene* scene, char* filename){	//Write a packed scene and its BVH to a .rscn file
+	FILE* output_pointer = fopen(filename, "wb");
+	Rscn_header header;
+	Scene_section sections[64];
+	int section_count = scene_sections(scene, sections);
+	char padding[RSCN_ALIGNMENT] = {0};
+	size_t offset;
+	int i;
+	
+	if(output_pointer == NULL){
+		fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+		exit(1);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "RSCN", 4);
+	header.version = RSCN_VERSION;
+	header.sphere_count = scene->spheres.count;
+	header.plane_count = scene->planes.count;
+	header.light_count = scene->lights.count;
+	header.node_count = scene->bvh.node_count;
+	header.camera_width = scene->camera_width;
+	header.camera_height = scene->camera_height;
+	
+	fwrite(&header, sizeof(header), 1, output_pointer);
+	offset = sizeof(header);
+	for(i = 0; i < section_count; i++){	//Pad up to each section, then write its array
+		fwrite(padding, 1, align_section(offset) - offset, output_pointer);
+		offset = align_section(offset);
+		fwrite(*sections[i].array, 1, sections[i].size, output_pointer);
+		offset += sections[i].size;
+	}
+	if(ferror(output_pointer) || fclose(output_pointer) != 0){
+		fprintf(stderr, "Error: Could not write file \"%s\"\n", filename);
+		exit(1);
+	}
+}
+
+//Return 1 if every index in the scene's BVH stays inside the scene, so a damaged .rscn file can not send traversal out of bounds
+//Children must come after their parent and belong to only one parent, and the tree must fit in a traversal stack
+int check_compiled_bvh(Scene* scene){
+	Bvh* bvh = &scene->bvh;
+	Bvh_node* node;
+	int* depth;
+	int valid = 1;
+	int i;
+	
+	if((bvh->node_count == 0) != (scene->spheres.count == 0)) return 0;
+	if(bvh->node_count > 2*(long)scene->spheres.count) return 0;	//build_bvh() never makes more nodes than that
+	for(i = 0; i < scene->spheres.count; i++){
+		if(bvh->indices[i] < 0 || bvh->indices[i] >= scene->spheres.count) return 0;
+	}
+	depth = malloc(sizeof(int)*(bvh->node_count + 1));
+	if(depth == NULL) return 0;
+	for(i = 0; i < bvh->node_count; i++) depth[i] = -1;	//-1 until a parent claims the node
+	depth[0] = 0;
+	for(i = 0; i < bvh->node_count && valid; i++){
+		node = &bvh->nodes[i];
+		if(node->count < 0 || node->start < 0 || node->axis < 0 || node->axis > 2){
+			valid = 0;
+		}else if(node->count > 0){	//Leaf, its run of spheres must lie inside indices
+			valid = node->start <= scene->spheres.count - node->count;
+		}else if(node->start <= i || node->start >= bvh->node_count - 1 || depth[node->start] != -1 || depth[node->start + 1] != -1){
+			valid = 0;
+		}else{
+			depth[node->start] = depth[node->start + 1] = depth[i] + 1;	//Unclaimed nodes stay at -1, and are never traversed
+			valid = depth[i] + 2 <= BVH_STACK_SIZE;	//Traversal keeps at most one node per level plus the two children
+		}
+	}
+	free(depth);
+	return valid;
+}
+
+//Map a .rscn file and point the scene's arrays straight into it
+//Returns 1 if it loaded and 0 (after printing why) if not, so --serve can turn a bad file away without exiting
+int open_compiled_scene(char* filename, Scene* scene){
+	Mapped_file file;
+	Rscn_header header;
+	Scene_section sections[64];
+	int section_count;
+	size_t offset;
+	int i;
+	
+	if(!open_mapped_file(filename, &file)) return 0;
+	if(file.size < sizeof(header) || memcmp(file.data, "RSCN", 4) != 0){
+		fprintf(stderr, "Error: \"%s\" is not a compiled scene\n", filename);
+		unmap_file(&file);
+		return 0;
+	}
+	memcpy(&header, file.data, sizeof(header));
+	if(header.version != RSCN_VERSION){
+		fprintf(stderr, "Error: \"%s\" was compiled by a different version of the raytracer, compile it again\n", filename);
+		unmap_file(&file);
+		return 0;
+	}
+	if(header.sphere_count < 0 || header.plane_count < 0 || header.light_count < 0 || header.node_count < 0){
+		fprintf(stderr, "Error: \"%s\" is not a compiled scene\n", filename);
+		unmap_file(&file);
+		return 0;
+	}
+	scene->camera_width = header.camera_width;
+	scene->camera_height = header.camera_height;
+	scene->spheres.count = header.sphere_count;
+	scene->planes.count = header.plane_count;
+	scene->lights.count = header.light_count;
+	scene->bvh.node_count = header.node_count;
+	
+	section_count = scene_sections(scene, sections);
+	offset = sizeof(header);
+	for(i = 0; i < section_count; i++){	//The mapping is page aligned, so every section stays RSCN_ALIGNMENT aligned in memory
+		offset = align_section(offset);
+		if(offset + sections[i].size > file.size){
+			fprintf(stderr, "Error: \"%s\" is truncated\n", filename);
+			unmap_file(&file);
+			return 0;
+		}
+		*sections[i].array = file.data + offset;
+		offset += sections[i].size;
+	}
+	if(!check_compiled_bvh(scene)){
+		fprintf(stderr, "Error: \"%s\" is not a compiled scene\n", filename);
+		unmap_file(&file);
+		return 0;
+	}
+	return 1;
+}
+
+void load_compiled_scene(char* filename, Scene* scene){	//Map a .rscn file, exiting if it can not be loaded
+	if(!open_compiled_scene(filename, scene)) exit(1);
+}
+
+void check_keyframes(Scene* scene, Keyframe* keyframes, int count){	//Make sure every keyframe moves an object the scene has
+	char* names[] = {"camera", "sphere", "plane", "light"};
+	int limits[4] = {1, scene->spheres.count, scene->planes.count, scene->lights.count};
+	int i;
+	for(i = 0; i < count; i++){
+		if(keyframes[i].index >= limits[keyframes[i].kind]){
+			fprintf(stderr, "Error: Keyframe %d moves %s %d, but the scene only has %d\n", i, names[keyframes[i].kind],
+					keyframes[i].index, limits[keyframes[i].kind]);
+			exit(1);
+		}
+	}
+}
+
+//Move every object with keyframes to where it is at frame, interpolating linearly between the keyframes around it
+//Objects stay put before their first keyframe and after their last one, returns 1 if any sphere moved
+int animate_scene(Scene* scene, Keyframe* keyframes, int count, int frame){
+	Keyframe* before;
+	Keyframe* after;
+	double position[3];
+	double t;
+	int moved = 0;
+	int i, j;
+	
+	for(i = 0; i < count; i++){
+		for(j = 0; j < i; j++){	//Each object is moved once, when its first keyframe comes up
+			if(keyframes[j].kind == keyframes[i].kind && keyframes[j].index == keyframes[i].index) break;
+		}
+		if(j < i) continue;
+		before = NULL;
+		after = NULL;
+		for(j = i; j < count; j++){	//Find the keyframes of this object on either side of frame
+			if(keyframes[j].kind != keyframes[i].kind || keyframes[j].index != keyframes[i].index) continue;
+			if(keyframes[j].frame <= frame && (before == NULL || keyframes[j].frame > before->frame)) before = &keyframes[j];
+			if(keyframes[j].frame >= frame && (after == NULL || keyframes[j].frame < after->frame)) after = &keyframes[j];
+		}
+		if(before == NULL) before = after;
+		if(after == NULL) after = before;
+		t = after->frame == before->frame ? 0 : (double)(frame - before->frame)/(after->frame - before->frame);
+		for(j = 0; j < 3; j++) position[j] = before->position[j] + t*(after->position[j] - before->position[j]);
+		
+		if(keyframes[i].kind == 0){
+			memcpy(scene->camera_position, position, sizeof(double)*3);
+		}else if(keyframes[i].kind == 1){
+			j = keyframes[i].index;
+			if(scene->spheres.x[j] != position[0] || scene->spheres.y[j] != position[1] || scene->spheres.z[j] != position[2]) moved = 1;
+			scene->spheres.x[j] = position[0];
+			scene->spheres.y[j] = position[1];
+			scene->spheres.z[j] = position[2];
+		}else if(keyframes[i].kind == 2){
+			j = keyframes[i].index;
+			scene->planes.x[j] = position[0];
+			scene->planes.y[j] = position[1];
+			scene->planes.z[j] = position[2];
+		}else{
+			memcpy(scene->lights.position[keyframes[i].index], position, sizeof(double)*3);
+		}
+	}
+	return moved;
+}
+
+//Render every frame of an animation back to back into output0000.ppm, output0001.ppm and so on, where output is output.ppm
+//The scene, its BVH and the framebuffer are set up once, and the BVH is only refit on frames where a sphere moved
+long render_animation(Scene* scene, Framebuffer* framebuffer, int N, int M, Keyframe* keyframes, int count, char* output, Stats* stats){
+	int stem_length = (int)strlen(output) - 4;	//Length of output without its .ppm extension
+	char* filename = malloc(strlen(output) + 16);
+	int frames = 0;
+	int frame;
+	long rays = 0;
+	long frame_rays;
+	int i;
+	
+	for(i = 0; i < count; i++){	//The last keyframe is the last frame
+		if(keyframes[i].frame + 1 > frames) frames = keyframes[i].frame + 1;
+	}
+	for(frame = 0; frame < frames; frame++){
+		if(animate_scene(scene, keyframes, count, frame)) refit_bvh(scene);
+		if(options.light_cutoff > 0) build_light_grid(scene, options.light_cutoff);	//Lights may have moved
+		clear_framebuffer(framebuffer);
+		frame_rays = raycast_frame(scene, framebuffer, N, M, stats);
+		if(frame_rays < 0){
+			fprintf(stderr, "Error: Could not allocate anti-aliasing buffers for a %dx%d image\n", framebuffer->width, framebuffer->height);
+			exit(1);
+		}
+		rays += frame_rays;
+		sprintf(filename, "%.*s%04d.ppm", stem_length, output, frame);
+		create_image(framebuffer, filename);
+	}
+	free(filename);
+	return rays;
+}
+
+//Load a scene for --serve, returns 1 if it loaded and 0 if not
+//The parser exits on errors, so the scene is compiled to a temporary .rscn file by running this same program with --compile-scene,
+//which is then mapped here
+int load_resident_scene(char* path, Scene* scene){
+	char directory[] = "/tmp/raytrace-XXXXXX";
+	char compiled[64];
+	char* arguments[] = {"raytrace", "--compile-scene", path, compiled, NULL};
+	pid_t child;
+	int status;
+	int loaded;
+	
+	if(!has_extension(path, ".json") && !has_extension(path, ".rscn")) return 0;
+	if(mkdtemp(directory) == NULL) return 0;
+	sprintf(compiled, "%s/scene.rscn", directory);
+	//A spawned process starts clean, where a forked copy of this threaded server would flush other connections' stdio buffers on exit
+	//Running /proc/self/exe rather than argv[0] makes sure the .rscn file is written by this very build
+	loaded = posix_spawn(&child, "/proc/self/exe", NULL, NULL, arguments, environ) == 0 &&
+		waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	if(loaded){
+		memset(scene, 0, sizeof(Scene));
+		loaded = open_compiled_scene(compiled, scene);
+	}
+	if(loaded && options.light_cutoff > 0) build_light_grid(scene, options.light_cutoff);	//Every request reads the same grid
+	unlink(compiled);	//The mapping keeps the file's contents until the server exits
+	rmdir(directory);
+	return loaded;
+}
+
+//Copy the scene loaded from path into scene, loading it first if needed
+//The cache is only locked to look the scene up, so requests for other scenes go ahead while one loads
+int find_resident_scene(Scene_cache* cache, char* path, Scene* scene){
+	Resident_scene* resident = NULL;
+	Scene loaded;
+	int waited = 0;
+	int found;
+	int i;
+	
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < cache->count && resident == NULL; i++){
+		if(strcmp(cache->scenes[i]->path, path) == 0) resident = cache->scenes[i];
+	}
+	if(resident == NULL){	//First request for this scene, add an entry that the load below fills in
+		if(cache->count == cache->capacity){
+			cache->capacity = cache->capacity == 0 ? 8 : 2*cache->capacity;
+			cache->scenes = realloc(cache->scenes, sizeof(Resident_scene*)*cache->capacity);
+		}
+		resident = malloc(sizeof(Resident_scene));
+		if(cache->scenes == NULL || resident == NULL){
+			fprintf(stderr, "Error: Out of memory while loading scene\n");
+			exit(1);
+		}
+		resident->path = strdup(path);
+		resident->state = SCENE_FAILED;
+		pthread_cond_init(&resident->loaded, NULL);
+		cache->scenes[cache->count++] = resident;
+	}
+	while(resident->state == SCENE_LOADING){	//Another request is loading it, wait for that load instead of starting our own
+		pthread_cond_wait(&resident->loaded, &cache->lock);
+		waited = 1;
+	}
+	if(resident->state == SCENE_FAILED && !waited){	//Scenes that failed to load are tried again, so a fixed file can be loaded
+		resident->state = SCENE_LOADING;
+		pthread_mutex_unlock(&cache->lock);
+		found = load_resident_scene(path, &loaded);
+		pthread_mutex_lock(&cache->lock);
+		if(found) resident->scene = loaded;
+		resident->state = found ? SCENE_LOADED : SCENE_FAILED;
+		pthread_cond_broadcast(&resident->loaded);
+	}
+	found = resident->state == SCENE_LOADED;
+	if(found) *scene = resident->scene;
+	pthread_mutex_unlock(&cache->lock);
+	return found;
+}
+
+//Answer one request line, either with a P6 image or with a line starting with "error"
+//Requests look like "render scene.json width height", optionally followed by the camera position x y z, then by "region x0 y0 x1 y1"
+void answer_request(Scene_cache* cache, char* request, FILE* output){
+	char path[1024];
+	Scene scene;
+	Framebuffer framebuffer;
+	Stats stats = {0};
+	double camera[3] = {0, 0, 0};
+	Region region;
+	char extra[2];
+	int has_region = 0;
+	int width;
+	int height;
+	int end = 0;
+	
+	if(sscanf(request, "render %1023s %d %d%n", path, &width, &height, &end) != 3){
+		fprintf(output, "error Requests look like: render scene.json width height [x y z] [region x0 y0 x1 y1]\n");
+		return;
+	}
+	request += end;
+	if(sscanf(request, " %lf %lf %lf%n", &camera[0], &camera[1], &camera[2], &end) == 3) request += end;
+	if(sscanf(request, " region %d %d %d %d%n", &region.x0, &region.y0, &region.x1, &region.y1, &end) == 4){
+		request += end;
+		has_region = 1;
+	}
+	if(sscanf(request, " %1s", extra) == 1){
+		fprintf(output, "error Requests look like: render scene.json width height [x y z] [region x0 y0 x1 y1]\n");
+		return;
+	}
+	if(width < 1 || height < 1 || width > 32768 || height > 32768){
+		fprintf(output, "error Width and height must be between 1 and 32768\n");
+		return;
+	}
+	if(has_region && (region.x0 < 0 || region.y0 < 0 || region.x0 >= region.x1 || region.y0 >= region.y1 ||
+						region.x1 > width || region.y1 > height)){
+		fprintf(output, "error The region must be a non-empty part of the image\n");
+		return;
+	}
+	if(!has_region) region = (Region){0, 0, width, height};
+	if((long)(region.x1 - region.x0)*(region.y1 - region.y0) > SERVE_MAX_PIXELS){
+		fprintf(output, "error A request can render at most %d pixels\n", SERVE_MAX_PIXELS);
+		return;
+	}
+	if(!find_resident_scene(cache, path, &scene)){
+		fprintf(output, "error Could not load scene %s\n", path);
+		return;
+	}
+	memcpy(scene.camera_position, camera, sizeof(double)*3);	//scene is this request's own copy, so other requests keep their camera
+	if(!allocate_framebuffer(&framebuffer, width, height, &region)){	//One request running out of memory must not take the server down
+		fprintf(output, "error Could not allocate a %dx%d framebuffer\n", framebuffer.width, framebuffer.height);
+		return;
+	}
+	if(raycast_frame(&scene, &framebuffer, width, height, &stats) < 0){
+		fprintf(output, "error Could not allocate anti-aliasing buffers for a %dx%d image\n", framebuffer.width, framebuffer.height);
+		free(framebuffer.data);
+		return;
+	}
+	write_image(&framebuffer, output);
+	free(framebuffer.data);
+}
+
+void* serve_connection(void* input){	//Thread entry point, answers a client's requests one line at a time until it hangs up
+	Connection* connection = input;
+	FILE* requests = fdopen(connection->fd, "r");
+	FILE* output = fdopen(dup(connection->fd), "w");
+	char request[2048];
+	
+	if(requests != NULL && output != NULL){
+		while(fgets(request, sizeof(request), requests) != NULL){
+			answer_request(connection->cache, request, output);
+			if(fflush(output) != 0) break;	//The client is gone
+		}
+	}
+	if(requests != NULL) fclose(requests);
+	if(output != NULL) fclose(output);
+	free(connection);
+	return NULL;
+}
+
+void serve(char* path){	//Listen on a Unix socket at path, answering every client on its own thread so requests run side by side
+	Scene_cache cache = {NULL, 0, 0};
+	struct sockaddr_un address;
+	Connection* connection;
+	pthread_t thread;
+	int listener;
+	int client;
+	
+	signal(SIGPIPE, SIG_IGN);	//A client hanging up mid image should only end its own connection
+	pthread_mutex_init(&cache.lock, NULL);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "Error: Socket path \"%s\" is too long\n", path);
+		exit(1);
+	}
+	strcpy(address.sun_path, path);
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);	//Remove a socket left behind by an earlier server
+	if(listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0){
+		fprintf(stderr, "Error: Could not listen on \"%s\"\n", path);
+		exit(1);
+	}
+	while(1){
+		client = accept(listener, NULL, NULL);
+		if(client < 0) continue;
+		connection = malloc(sizeof(Connection));
+		connection->fd = client;
+		connection->cache = &cache;
+		if(pthread_create(&thread, NULL, serve_connection, connection) != 0){
+			close(client);
+			free(connection);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+double elapsed_seconds(struct timespec* start){	//Return the seconds passed since start
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+void print_stats(Stats* stats, double load_time, double render_time, double write_time){	//Print the --stats report
+	long rays = total_rays(stats);
+	fprintf(stderr, "Load scene:      %.3f s\n", load_time);
+	fprintf(stderr, "Raycast scene:   %.3f s\n", render_time);
+	fprintf(stderr, "Create image:    %.3f s\n", write_time);
+	fprintf(stderr, "Rays:            %ld (%.0f per second)\n", rays, render_time > 0 ? rays/render_time : 0);
+	fprintf(stderr, "  Primary:       %ld\n", stats->primary_rays);
+	fprintf(stderr, "  Shadow:        %ld\n", stats->shadow_rays);
+	fprintf(stderr, "  Reflection:    %ld\n", stats->reflection_rays);
+	fprintf(stderr, "  Refraction:    %ld\n", stats->refraction_rays);
+	fprintf(stderr, "Sphere tests:    %ld\n", stats->sphere_tests);
+	fprintf(stderr, "Plane tests:     %ld\n", stats->plane_tests);
+	fprintf(stderr, "Deepest layer:   %d\n", stats->max_depth);
+}
+
 int main(int c, char** argv) {	//This recieves our input.json and runs functions on it to create an output.ppm
-	Object** object_array = malloc(sizeof(Object*)*130);	//Create array of object pointers
+	Scene scene = {NULL, -1, 0};	//Empty scene, read_scene() grows it as objects are parsed
 	int width;
 	int height;
-	double** pixel_buffer;
-	int object_counter;
-	int counter = 0;
-	object_array[129] = NULL;	//Indicate end of object pointer array with a NULL
+	Framebuffer framebuffer;
+	Stats stats = {0};
+	Keyframe* keyframes = NULL;
+	int keyframe_count = 0;
+	struct timespec start;
+	double load_time;
+	double render_time;
+	double write_time;
+	
+	c = argument_checker(c, argv);	//Check our arguments to make sure they written correctly, this also removes any options from argv
+	
+	if(options.compile_scene){	//Parse and pack the scene, then save it instead of rendering
+		if(has_extension(argv[1], ".rscn")){	//Checks a compiled scene and copies it, which --serve relies on
+			load_compiled_scene(argv[1], &scene);
+		}else{
+			read_scene(argv[1], &scene);
+			move_camera_to_front(scene.object_array, scene.object_counter);
+			pack_scene(&scene);
+			build_bvh(&scene);
+		}
+		write_compiled_scene(&scene, argv[2]);
+		return 0;
+	}
+	
+	if(options.diff >= 0){	//Compare two images instead of rendering, the exit status says if they match
+		return diff_images(argv[1], argv[2], options.diff);
+	}
+	
+	if(options.merge){	//Stitch rendered regions together instead of rendering
+		merge_images(argv[1], &argv[2], c - 2);
+		return 0;
+	}
 	
-	argument_checker(c, argv);	//Check our arguments to make sure they written correctly
+	select_sphere_kernel();	//Pick the sphere intersection kernel for this processor
+	if(options.serve != NULL){	//Keep answering render requests until the process is stopped
+		serve(options.serve);
+		return 0;
+	}
 	
 	width = atoi(argv[1]);
 	height = atoi(argv[2]);
 	
-	pixel_buffer = malloc(sizeof(double*)*(width*height + 1));	//Create our pixel array to hold color values
-	pixel_buffer[width*height] = NULL;
-	
-	while(counter < width*height){	//Reserve space for each pixel in our pixel array
-		pixel_buffer[counter] = malloc(sizeof(double)*3);
-		pixel_buffer[counter][0] = 0;
-		pixel_buffer[counter][1] = 0;
-		pixel_buffer[counter][2] = 0;
-		counter++;
+	create_framebuffer(&framebuffer, width, height, options.region.x1 > 0 ? &options.region : NULL);	//Create our framebuffer to hold color values
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(has_extension(argv[3], ".rscn")){	//Compiled scenes are already packed, with their BVH built
+		load_compiled_scene(argv[3], &scene);
+	}else{
+		read_scene(argv[3], &scene);	//Parse .json scene file
+		move_camera_to_front(scene.object_array, scene.object_counter);	//Make camera the first object in our object array
+		pack_scene(&scene);	//Pack the parsed objects into arrays by kind
+		build_bvh(&scene);	//Build our acceleration structure over the packed spheres
+	}
+	if(options.light_cutoff > 0) build_light_grid(&scene, options.light_cutoff);	//Cull the lights that can not reach a point
+	if(options.animate != NULL){
+		keyframe_count = read_keyframes(options.animate, &keyframes);
+		check_keyframes(&scene, keyframes, keyframe_count);
+	}
+	load_time = elapsed_seconds(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(options.animate != NULL){	//Every frame is written out as soon as it is done, so writing is timed along with raycasting
+		render_animation(&scene, &framebuffer, width, height, keyframes, keyframe_count, argv[4], &stats);
+		render_time = elapsed_seconds(&start);
+		write_time = 0;
+		free(keyframes);
+	}else if(options.progressive){	//Every pass is written out as soon as it is done, so writing is timed along with raycasting
+		render_progressive(&scene, &framebuffer, width, height, argv[4], &stats);
+		render_time = elapsed_seconds(&start);
+		write_time = 0;
+	}else{
+		if(raycast_frame(&scene, &framebuffer, width, height, &stats) < 0){	//Raycast our scene into the framebuffer
+			fprintf(stderr, "Error: Could not allocate anti-aliasing buffers for a %dx%d image\n", framebuffer.width, framebuffer.height);
+			exit(1);
+		}
+		render_time = elapsed_seconds(&start);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		create_image(&framebuffer, argv[4]);	//Put info from the framebuffer into a P6 PPM file
+		write_time = elapsed_seconds(&start);
 	}
-	object_counter = read_scene(argv[3], object_array);	//Parse .json scene file
-	move_camera_to_front(object_array, object_counter);	//Make camera the first object in our object array
-	raycast_scene(object_array, object_counter, pixel_buffer, width, height);	//Raycast our scene into the pixel array
-	create_image(pixel_buffer, argv[4], width, height);	//Put info from pixel array into a P6 PPM file
+	if(options.stats) print_stats(&stats, load_time, render_time, write_time);
 	
 	return 0;
 }
\ No newline at end of file